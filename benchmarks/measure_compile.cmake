@@ -0,0 +1,20 @@
+# Compiles one TU a few times and prints the average wall time and the size
+# of the object file. Needs CMake >= 3.23 for sub-second timestamps.
+#
+# Usage: cmake "-DCOMMAND=<compile command>" -DOBJECT=<output path>
+#              -DNUM_RUNS=<n> -P measure_compile.cmake
+
+separate_arguments(COMMAND UNIX_COMMAND "${COMMAND}")
+string(TIMESTAMP start "%s%f")
+foreach(run RANGE 1 ${NUM_RUNS})
+  execute_process(COMMAND ${COMMAND} RESULT_VARIABLE result)
+  if (NOT result EQUAL 0)
+    message(FATAL_ERROR "Compilation failed: ${COMMAND}")
+  endif()
+endforeach()
+string(TIMESTAMP end "%s%f")
+math(EXPR average_ms "(${end} - ${start}) / 1000 / ${NUM_RUNS}")
+file(SIZE "${OBJECT}" size)
+math(EXPR size_kib "${size} / 1024")
+message("compile_time:       ${average_ms} ms (average of ${NUM_RUNS})")
+message("object_size:        ${size_kib} KiB")
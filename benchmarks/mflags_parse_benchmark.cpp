@@ -0,0 +1,115 @@
+// Measures the parse time of a large argv.
+//
+// Usage: ./mflags_parse_benchmark [num_tokens]
+//
+// Reports:
+//   parse: ArgsDescriptor::ParseFlagsInternal of the whole argv.
+//   commands/<kind>: ParseFlagsInternal of one short command, like those of
+//     an admin socket, with a reused ArgsDescriptor. ok commands are valid,
+//     error ones are rejected, and error+str ones also format the error text.
+
+#include "mflags.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Median time of @num_runs calls of @func, in microseconds.
+template<typename F>
+int64_t MedianUs(int num_runs, F func) {
+  std::vector<int64_t> times;
+  for (int i = 0; i < num_runs; i++) {
+    auto start = NowNs();
+    func();
+    times.push_back(NowNs() - start);
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2] / 1000;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t num_tokens = argc > 1 ? std::atoll(argv[1]) : 1000000;
+  constexpr int kNumRuns = 11;
+
+  // "-f1 <values...>" followed by "--f2=<value>" pairs, "-f3 ID NAME" triples
+  // and "--flag4 <value>" pairs, repeated.
+  std::vector<std::string> strings;
+  for (size_t i = 0; strings.size() < num_tokens; i++) {
+    auto id = std::to_string(i);
+    switch (i % 4) {
+      case 0: strings.insert(strings.end(), {"-f1", id, "value_" + id}); break;
+      case 1: strings.push_back("--f2=" + id); break;
+      case 2: strings.insert(strings.end(), {"-f3", id, "name_" + id}); break;
+      case 3: strings.insert(strings.end(), {"--flag4", "some/path/" + id});
+    }
+  }
+  std::vector<const char*> tokens{"mflags_parse_benchmark"};
+  for (auto& str : strings) tokens.push_back(str.c_str());
+
+  std::cout << "num_tokens:         " << tokens.size() - 1 << "\n";
+
+  auto parse_time_us = MedianUs(kNumRuns, [&] {
+    std::vector<const char*> f1;
+    int f2 = 0;
+    std::vector<std::pair<int, const char*>> f3;
+    const char* f4 = nullptr;
+    mflags::ArgsDescriptor args_desc{};
+    args_desc.AddArg({.names={"-f1"}}, &f1);
+    args_desc.AddArg({.names={"--f2"}}, &f2);
+    args_desc.AddArg({.names={"-f3"}}, &f3);
+    args_desc.AddArg({.names={"--flag4"}}, &f4);
+    if (!args_desc.ParseFlagsInternal(tokens).ok()) std::abort();
+  });
+  std::cout << "parse:              " << parse_time_us << " us (median)\n";
+
+  // Commands of 3 to 5 tokens, where every error command fails in a
+  // different way: Invalid value, invalid tuple element, number of args and
+  // unrecognized param.
+  int shard = 0;
+  double weight = 0;
+  std::pair<int, std::string> route;
+  mflags::ArgsDescriptor command_desc{};
+  command_desc.AddArg({.names={"--shard"}}, &shard);
+  command_desc.AddArg({.names={"--weight"}}, &weight);
+  command_desc.AddArg({.names={"--route"}}, &route);
+  std::vector<std::vector<const char*>> ok_commands = {
+      {"set", "--shard", "7", "--weight=0.5"},
+      {"set", "--route", "3", "eu-west"},
+      {"set", "--shard=12", "--route", "4", "us-east"}};
+  std::vector<std::vector<const char*>> error_commands = {
+      {"set", "--shard", "seven", "--weight=0.5"},
+      {"set", "--route", "x", "eu-west"},
+      {"set", "--shard=12", "--route", "4"},
+      {"set", "--shard", "7", "extra"}};
+  constexpr int kNumCommands = 20000;
+  for (auto [kind, commands, format] :
+       {std::make_tuple("ok", &ok_commands, false),
+        std::make_tuple("error", &error_commands, false),
+        std::make_tuple("error+str", &error_commands, true)}) {
+    size_t text_size = 0;
+    auto time_us = MedianUs(kNumRuns, [&, commands = commands,
+                                       format = format] {
+      for (int i = 0; i < kNumCommands; i++) {
+        auto status = command_desc.ParseFlagsInternal(
+            (*commands)[i % commands->size()]);
+        if (format) text_size += status.str().size();
+      }
+    });
+    std::string name = std::string("commands/") + kind + ":";
+    std::cout << name << std::string(20 - name.size(), ' ')
+              << time_us * 1000 / kNumCommands << " ns per command (median)\n";
+  }
+}
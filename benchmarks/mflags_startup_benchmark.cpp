@@ -0,0 +1,123 @@
+// Measures the startup cost of many ADD_GLOBAL_MFLAGs spread across many TUs.
+//
+// This file is linked twice (see benchmarks/CMakeLists.txt): once together
+// with generated TUs full of global flags, and once alone as the baseline.
+// Comparing the two gives the cost of the global flags registry.
+//
+// Usage: ./mflags_startup_benchmark [num_runs]
+//
+// Every run re-executes the binary, which reports:
+//   time_to_main: From just before exec, till the start of main.
+//   parse: mflags::ParseFlags with an empty argv.
+//   rss_at_main, rss_after_parse: VmRSS of the process.
+
+#include "mflags.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef MFLAGS_BENCHMARK_NUM_FLAGS
+#define MFLAGS_BENCHMARK_NUM_FLAGS 0
+#endif
+
+namespace {
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t RssKb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmRSS:", 0) == 0) return std::atoll(line.c_str() + 6);
+  }
+  return -1;
+}
+
+struct RunResult {
+  int64_t time_to_main_ns = 0;
+  int64_t parse_ns = 0;
+  int64_t rss_at_main_kb = 0;
+  int64_t rss_after_parse_kb = 0;
+};
+
+int ChildMain(int64_t exec_start_ns, int output_fd) {
+  RunResult result;
+  result.time_to_main_ns = NowNs() - exec_start_ns;
+  result.rss_at_main_kb = RssKb();
+  const char* argv[] = {"mflags_startup_benchmark"};
+  auto start = NowNs();
+  mflags::ParseFlags(1, argv);
+  result.parse_ns = NowNs() - start;
+  result.rss_after_parse_kb = RssKb();
+  return write(output_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+bool RunChild(RunResult& result) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  auto fd_str = std::to_string(fds[1]);
+  auto start_str = std::to_string(NowNs());
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    execl("/proc/self/exe", "mflags_startup_benchmark", "--child",
+          start_str.c_str(), fd_str.c_str(), nullptr);
+    _exit(127);
+  }
+  close(fds[1]);
+  bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+  close(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template<typename F>
+int64_t Median(std::vector<RunResult>& results, F field) {
+  std::sort(results.begin(), results.end(),
+            [&](auto& a, auto& b) { return field(a) < field(b); });
+  return field(results[results.size() / 2]);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc == 4 && std::string(argv[1]) == "--child") {
+    return ChildMain(std::atoll(argv[2]), std::atoi(argv[3]));
+  }
+  int num_runs = argc > 1 ? std::max(1, std::atoi(argv[1])) : 20;
+  std::vector<RunResult> results(num_runs);
+  for (auto& result : results) {
+    if (!RunChild(result)) {
+      std::cerr << "Failed to run the benchmark child process" << std::endl;
+      return 1;
+    }
+  }
+  struct stat exe_stat {};
+  stat("/proc/self/exe", &exe_stat);
+  std::cout << "num_flags:          " << MFLAGS_BENCHMARK_NUM_FLAGS << "\n"
+            << "num_runs:           " << num_runs << "\n"
+            << "binary_size:        " << exe_stat.st_size / 1024 << " KiB\n"
+            << "time_to_main:       " << Median(results, [](auto& r) {
+                 return r.time_to_main_ns; }) / 1000 << " us (median)\n"
+            << "parse:              " << Median(results, [](auto& r) {
+                 return r.parse_ns; }) / 1000 << " us (median)\n"
+            << "rss_at_main:        " << Median(results, [](auto& r) {
+                 return r.rss_at_main_kb; }) << " KiB (median)\n"
+            << "rss_after_parse:    " << Median(results, [](auto& r) {
+                 return r.rss_after_parse_kb; }) << " KiB (median)\n";
+}
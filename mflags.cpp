@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <limits>
 #include <vector>
 #include <map>
@@ -9,10 +10,175 @@
 #include <sstream>
 #include <string_view>
 #include <optional>
+#include <charconv>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <cctype>
+#include <fstream>
+#include <cstring>
+#include <cstddef>
 
 #include "mflags.h"
 
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace mflags {
+
+namespace mflags_impl {
+
+#define MFLAGS_INSTANTIATE_ARG_DESC(...)                                    \
+  template OneArgDesc MakeArgDesc(ArgDescOpts, __VA_ARGS__&);               \
+  template OneArgDesc MakeGlobalArgDesc<__VA_ARGS__>(const GlobalFlagNode&);
+
+MFLAGS_FOR_EACH_CORE_SHAPE(MFLAGS_INSTANTIATE_ARG_DESC)
+
+#undef MFLAGS_INSTANTIATE_ARG_DESC
+
+template bool CstrToCoreTypes(const char*, int&);
+template bool CstrToCoreTypes(const char*, double&);
+template bool CstrToCoreTypes(const char*, std::string&);
+
+}  // namespace mflags_impl
+
+Status Status::InvalidValue(std::string_view field_name, const char* token,
+                            TypeNameFunc type_name,
+                            TypeNameFunc tuple_type_name) {
+  Status status(ErrorCode::kInvalidValue, field_name);
+  status.token_ = token;
+  status.type_name_ = type_name;
+  status.tuple_type_name_ = tuple_type_name;
+  return status;
+}
+
+Status Status::InvalidNumArgs(std::string_view field_name, size_t expected,
+                              size_t found, TypeNameFunc type_name,
+                              bool is_tuple) {
+  Status status(ErrorCode::kInvalidNumArgs, field_name);
+  status.expected_ = expected;
+  status.found_ = found;
+  status.type_name_ = type_name;
+  status.is_tuple_ = is_tuple;
+  return status;
+}
+
+Status Status::InvalidMapEntry(std::string_view field_name, const char* token,
+                               MapEntryPart part, TypeNameFunc type_name) {
+  Status status(ErrorCode::kInvalidValue, field_name);
+  status.token_ = token;
+  status.map_entry_part_ = part;
+  status.type_name_ = type_name;
+  status.is_map_entry_ = true;
+  return status;
+}
+
+Status Status::UnrecognizedParam(const char* const* tokens, int num_tokens) {
+  Status status(ErrorCode::kUnrecognizedParam, {});
+  std::copy_n(tokens, std::min(num_tokens, kMaxUnrecognizedTokens),
+              status.tokens_);
+  status.num_tokens_ = num_tokens;
+  return status;
+}
+
+Status Status::MissingPositional(std::string_view name) {
+  return Status(ErrorCode::kMissingPositional, name);
+}
+
+std::string Status::FormatStructured() const {
+  std::ostringstream oss;
+  switch (code_) {
+    case ErrorCode::kInvalidValue:
+      if (is_map_entry_) {
+        FormatMapEntryError(oss);
+        break;
+      }
+      oss << "Failed to parse `" << token() << "` as type " << type_name_()
+          << " for field " << field_prefix_ << field_name_;
+      if (tuple_type_name_ != nullptr) {
+        oss << ". Expected args of " << field_prefix_ << field_name_
+            << " to be parsable for " << tuple_type_name_();
+      }
+      break;
+    case ErrorCode::kInvalidNumArgs:
+      oss << "Invalid number of args for `" << field_prefix_ << field_name_
+          << "`. Expected " << expected_ << " found " << found_
+          << (is_tuple_ ? ". Should be parsable for " : ". Should be of type ")
+          << type_name_();
+      break;
+    case ErrorCode::kUnrecognizedParam:
+      oss << "Unrecognized param:";
+      if (tokens_copied_) oss << ' ' << token_copy_;
+      for (int i = 0; i < std::min(num_tokens_, kMaxUnrecognizedTokens) &&
+                      !tokens_copied_; i++) {
+        oss << ' ' << tokens_[i];
+      }
+      if (num_tokens_ > kMaxUnrecognizedTokens) {
+        oss << " (and " << num_tokens_ - kMaxUnrecognizedTokens << " more)";
+      }
+      break;
+    case ErrorCode::kMissingPositional:
+      oss << "Required positional arg " << field_name_ << " not found.";
+      break;
+    default:
+      break;
+  }
+  return oss.str();
+}
+
+void Status::FormatMapEntryError(std::ostringstream& oss) const {
+  std::string_view token(this->token());
+  auto equal_pos = token.find('=');
+  switch (map_entry_part_) {
+    case MapEntryPart::kEntry:
+      oss << "Expected `key=value` but found `" << token << "` for field "
+          << field_prefix_ << field_name_ << " of type " << type_name_();
+      return;
+    case MapEntryPart::kKey:
+      oss << "Failed to parse key `" << token.substr(0, equal_pos) << "`";
+      break;
+    case MapEntryPart::kValue:
+      oss << "Failed to parse value `" << token.substr(equal_pos + 1) << "`";
+      break;
+  }
+  oss << " as type " << type_name_() << " for field " << field_prefix_
+      << field_name_;
+}
+
+void Status::CopyTokens() {
+  if (tokens_copied_) return;
+  if (token_ != nullptr) token_copy_ = token_;
+  for (int i = 0; i < std::min(num_tokens_, kMaxUnrecognizedTokens); i++) {
+    if (i > 0) token_copy_ += ' ';
+    token_copy_ += tokens_[i];
+  }
+  token_ = nullptr;
+  std::fill(std::begin(tokens_), std::end(tokens_), nullptr);
+  tokens_copied_ = true;
+}
+
+std::string Status::str() const {
+  if (message_.has_value()) return message_->str();
+  return FormatStructured();
+}
+
+std::ostringstream& Status::Message() {
+  if (!message_.has_value()) {
+    message_.emplace(FormatStructured(), std::ios_base::ate);
+  }
+  return *message_;
+}
+
+Status& Status::WithContext(std::string_view context) {
+  std::string text = str();
+  message_.emplace();
+  *message_ << context << ": " << text;
+  return *this;
+}
+
 namespace {
 
 bool SplitOnEqual(std::string_view sv, std::string_view& first,
@@ -27,97 +193,504 @@ bool SplitOnEqual(std::string_view sv, std::string_view& first,
   return false;
 }
 
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds a span from its construction till destruction to @tracer, if it's not
+// nullptr. Costs only a branch otherwise.
+class TraceSpan {
+ public:
+  TraceSpan(ParseTracer* tracer, const char* name,
+            std::string_view field_name = {}): tracer_(tracer) {
+    if (tracer_ == nullptr) return;
+    span_.name = name;
+    span_.field_name = field_name;
+    span_.start_ns = NowNs();
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    if (tracer_ == nullptr) return;
+    span_.duration_ns = NowNs() - span_.start_ns;
+    tracer_->AddSpan(std::move(span_));
+  }
+
+ private:
+  ParseTracer* tracer_;
+  ParseTracer::Span span_;
+};
+
+void AppendJsonString(std::string_view str, std::string& output) {
+  output += '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      output += '\\';
+      output += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      output += buffer;
+    } else {
+      output += c;
+    }
+  }
+  output += '"';
+}
+
+// Identifies the running binary: ELF build-id of the main executable, empty
+// if it has none.
+const std::string& BuildId() {
+  static const std::string build_id = [] {
+    std::string output;
+    dl_iterate_phdr([](dl_phdr_info* info, size_t, void* data) {
+      auto& output = *static_cast<std::string*>(data);
+      for (int i = 0; i < info->dlpi_phnum; i++) {
+        auto& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_NOTE) continue;
+        auto note = reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+        auto end = note + phdr.p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+          auto nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+          auto name = note + sizeof(ElfW(Nhdr));
+          auto desc = name + ((nhdr->n_namesz + 3) & ~3u);
+          if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+              std::memcmp(name, "GNU", 4) == 0) {
+            output.assign(desc, nhdr->n_descsz);
+            return 1;
+          }
+          note = desc + ((nhdr->n_descsz + 3) & ~3u);
+        }
+      }
+      // The main executable comes first, the shared libraries are skipped.
+      return 1;
+    }, &output);
+    return output;
+  }();
+  return build_id;
+}
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ull;
+
+uint64_t FnvHash(std::string_view bytes, uint64_t hash = kFnvOffset) {
+  for (char c : bytes) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Hash of all the flag names, in order, to tell whether a cached
+// FlagNameIndex was built for the same flags.
+uint64_t RegistryHash(const std::vector<OneArgDesc>& arg_desc_list) {
+  uint64_t hash = kFnvOffset;
+  for (auto& desc : arg_desc_list) {
+    for (auto& name : desc.opts.names) {
+      hash = FnvHash(std::string_view(name.c_str(), name.size() + 1), hash);
+    }
+    hash = FnvHash("\n", hash);
+  }
+  return hash;
+}
+
+constexpr uint64_t kFlagNameIndexMagic = 0x6d666c6167690002;
+constexpr size_t kMaxBuildIdSize = 64;
+constexpr uint32_t kEmptySlot = std::numeric_limits<uint32_t>::max();
+
+struct FlagNameIndexHeader {
+  uint64_t magic;
+  // Of the rest of the header and the slots, see IndexChecksum.
+  uint64_t checksum;
+  uint64_t registry_hash;
+  uint32_t build_id_size;
+  uint8_t build_id[kMaxBuildIdSize];
+  // A power of 2.
+  uint32_t num_slots;
+  uint32_t min_name_size;
+  uint32_t max_name_size;
+  // Whether any name starts with the byte.
+  uint8_t first_bytes[256];
+};
+
+struct FlagNameSlot {
+  uint32_t hash;
+  // kEmptySlot in the unused slots.
+  uint32_t desc_index;
+  // Index in OneArgDesc::opts.names.
+  uint32_t name_index;
+};
+
+// Checksum of the FlagNameIndex of @size bytes at @data, from the field after
+// FlagNameIndexHeader::checksum. Hashes 8 bytes at a time, so that checking
+// a cached index stays cheap next to building it.
+uint64_t IndexChecksum(const void* data, size_t size) {
+  auto bytes = static_cast<const char*>(data);
+  size_t start = offsetof(FlagNameIndexHeader, registry_hash);
+  uint64_t hash = kFnvOffset ^ size;
+  size_t i = start;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, sizeof(word));
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  }
+  return FnvHash(std::string_view(bytes + i, size - i), hash);
+}
+
+// Open addressing hash table of the flag names. Its memory is flat, so that
+// it's saved to and mapped from the index cache as is.
+class FlagNameIndex {
+ public:
+  FlagNameIndex(const std::vector<OneArgDesc>& arg_desc_list,
+                std::pmr::memory_resource* resource)
+      : arg_desc_list_(arg_desc_list), buffer_(resource) { }
+  FlagNameIndex(const FlagNameIndex&) = delete;
+  FlagNameIndex& operator=(const FlagNameIndex&) = delete;
+  ~FlagNameIndex() {
+    if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+  }
+
+  Status Build(uint64_t registry_hash, const std::string& build_id);
+
+  // Uses the index saved at @path if it's built for the same flags and
+  // binary. Returns false if it isn't.
+  bool Map(const std::string& path, uint64_t registry_hash,
+           const std::string& build_id);
+
+  // Best effort, errors are ignored: The index is rebuilt without the cache.
+  void Save(const std::string& path) const;
+
+  const OneArgDesc* Find(std::string_view name) const {
+    // Cheap filter of the plain values: First bytes and size range of names.
+    if (name.size() < header_->min_name_size ||
+        name.size() > header_->max_name_size ||
+        (!name.empty() &&
+         !header_->first_bytes[static_cast<unsigned char>(name[0])])) {
+      return nullptr;
+    }
+    uint32_t hash = static_cast<uint32_t>(FnvHash(name));
+    uint32_t mask = header_->num_slots - 1;
+    // Bounded, as a table without empty slots would loop forever.
+    for (uint32_t i = hash & mask, probes = 0; probes < header_->num_slots;
+         i = (i + 1) & mask, probes++) {
+      auto& slot = slots_[i];
+      if (slot.desc_index == kEmptySlot) return nullptr;
+      // Indexes are checked too, as the checksum of a cached index only
+      // catches corrupt files, not ones written by another program.
+      if (slot.hash != hash || slot.desc_index >= arg_desc_list_.size()) {
+        continue;
+      }
+      auto& desc = arg_desc_list_[slot.desc_index];
+      if (slot.name_index < desc.opts.names.size() &&
+          desc.opts.names[slot.name_index] == name) {
+        return &desc;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  size_t Size() const {
+    return sizeof(FlagNameIndexHeader) +
+           header_->num_slots * sizeof(FlagNameSlot);
+  }
+
+  const std::vector<OneArgDesc>& arg_desc_list_;
+  // Memory of a built index.
+  std::pmr::vector<uint64_t> buffer_;
+  // Or of a mapped one.
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  const FlagNameIndexHeader* header_ = nullptr;
+  const FlagNameSlot* slots_ = nullptr;
+};
+
+Status FlagNameIndex::Build(uint64_t registry_hash,
+                            const std::string& build_id) {
+  size_t num_names = 0;
+  for (auto& desc : arg_desc_list_) num_names += desc.opts.names.size();
+  uint32_t num_slots = 2;
+  while (num_slots < 2 * num_names) num_slots *= 2;
+  size_t size = sizeof(FlagNameIndexHeader) + num_slots * sizeof(FlagNameSlot);
+  buffer_.assign((size + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+  auto header = reinterpret_cast<FlagNameIndexHeader*>(buffer_.data());
+  auto slots = reinterpret_cast<FlagNameSlot*>(header + 1);
+  header->magic = kFlagNameIndexMagic;
+  header->registry_hash = registry_hash;
+  header->build_id_size = static_cast<uint32_t>(
+      std::min(build_id.size(), kMaxBuildIdSize));
+  std::memcpy(header->build_id, build_id.data(), header->build_id_size);
+  header->num_slots = num_slots;
+  header->min_name_size = std::numeric_limits<uint32_t>::max();
+  for (uint32_t i = 0; i < num_slots; i++) slots[i] = {0, kEmptySlot, 0};
+  header_ = header;
+  slots_ = slots;
+  for (size_t desc_index = 0; desc_index < arg_desc_list_.size();
+       desc_index++) {
+    auto& desc = arg_desc_list_[desc_index];
+    for (size_t name_index = 0; name_index < desc.opts.names.size();
+         name_index++) {
+      std::string_view name = desc.opts.names[name_index];
+      header->min_name_size = std::min<uint32_t>(header->min_name_size,
+                                                 name.size());
+      header->max_name_size = std::max<uint32_t>(header->max_name_size,
+                                                 name.size());
+      if (!name.empty()) {
+        header->first_bytes[static_cast<unsigned char>(name[0])] = 1;
+      }
+      if (auto other = Find(name)) {
+        return Status::Error("Field name `") << name
+          << "` declared twice across in "
+          << "argument descriptions. One at " << other->filename
+          << " and other one at " << desc.filename;
+      }
+      uint32_t hash = static_cast<uint32_t>(FnvHash(name));
+      uint32_t i = hash & (num_slots - 1);
+      while (slots[i].desc_index != kEmptySlot) i = (i + 1) & (num_slots - 1);
+      slots[i] = {hash, static_cast<uint32_t>(desc_index),
+                  static_cast<uint32_t>(name_index)};
+    }
+  }
+  header->checksum = IndexChecksum(header, size);
+  return Status::OK;
+}
+
+bool FlagNameIndex::Map(const std::string& path, uint64_t registry_hash,
+                        const std::string& build_id) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat file_stat {};
+  void* mapping = MAP_FAILED;
+  if (fstat(fd, &file_stat) == 0 &&
+      static_cast<size_t>(file_stat.st_size) >= sizeof(FlagNameIndexHeader)) {
+    mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  mapping_ = mapping;
+  mapping_size_ = file_stat.st_size;
+  auto header = static_cast<const FlagNameIndexHeader*>(mapping);
+  auto slots = reinterpret_cast<const FlagNameSlot*>(header + 1);
+  bool valid = header->magic == kFlagNameIndexMagic &&
+      header->registry_hash == registry_hash &&
+      std::string_view(reinterpret_cast<const char*>(header->build_id),
+                       std::min<size_t>(header->build_id_size,
+                                        kMaxBuildIdSize)) == build_id &&
+      header->num_slots > 0 &&
+      (header->num_slots & (header->num_slots - 1)) == 0 &&
+      mapping_size_ == sizeof(FlagNameIndexHeader) +
+                       size_t{header->num_slots} * sizeof(FlagNameSlot) &&
+      header->checksum == IndexChecksum(mapping_, mapping_size_);
+  if (!valid) {
+    munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    return false;
+  }
+  header_ = header;
+  slots_ = slots;
+  return true;
+}
+
+void FlagNameIndex::Save(const std::string& path) const {
+  // A new file of a unique name, in the directory of @path for the rename
+  // below, so that a file or symlink planted at a predictable name isn't
+  // written through.
+  std::string tmp_path = path + ".XXXXXX";
+  int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+  if (fd < 0) return;
+  // Readable by other users, as the caches are shared.
+  fchmod(fd, 0644);
+  auto data = reinterpret_cast<const char*>(header_);
+  size_t size = Size(), written = 0;
+  while (written < size) {
+    auto result = write(fd, data + written, size - written);
+    if (result <= 0) break;
+    written += result;
+  }
+  close(fd);
+  // Renamed, so that other processes never map a partly written file.
+  if (written != size || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
 class Parser {
  public:
-  Parser() = default;
+  // @index_cache_dir is ArgsDescriptor::SetIndexCacheDir, empty if unset.
+  // Memory of the parse is allocated from @resource.
+  Parser(const std::vector<OneArgDesc>& arg_desc_list, ParseTracer* tracer,
+         const std::string& index_cache_dir,
+         std::pmr::memory_resource* resource)
+      : arg_desc_list_(arg_desc_list), field_names_(arg_desc_list, resource),
+        index_cache_dir_(index_cache_dir), field_values_(resource),
+        positional_args_(resource), resource_(resource), tracer_(tracer) { }
 
-  Status ParseFlags(int argc, const char* const* argv,
-                    std::vector<OneArgDesc> arg_desc_list);
+  Status ParseFlags(int argc, const char* const* argv);
+
+  // Sets (*sources)[i] to the name of the layer which set arg_desc_list[i].
+  Status ParseLayers(const std::vector<FlagLayer>& layers,
+                     std::vector<std::string>* sources);
 
  private:
 
   Status PreprocessArgDescList();
 
-  void CreateFieldValues(int argc, const char* const* argv);
+  // @argv are the command line args without the program name.
+  Status CreateFieldValues(int argc, const char* const* argv);
+
+  // Starts a field value of the flag @name, with args from resource_.
+  FieldArgs& AddFieldValue(std::string_view name);
+
+  // Parses the last field value right away, if it's of a sink flag, so that
+  // sink values aren't buffered. @close tells whether the field is complete.
+  Status FlushSinkField(bool close);
 
   Status ParsePositionalArgs();
 
+  // Index of @token in tokens_, -1 if it's not there.
+  int TokenIndex(const char* token) const;
+
+  // Sets the location of an error of @arg_desc in parsing @field_args.
+  Status Locate(Status status, const OneArgDesc* arg_desc,
+                const FieldArgs& field_args) const;
+
  private:
-  std::vector<OneArgDesc> arg_desc_list_;
+  const std::vector<OneArgDesc>& arg_desc_list_;
 
   // Generally field_names are of form "--flag"
-  std::map<std::string_view, const OneArgDesc*> field_names_map_;
-  
-  std::vector<FieldArgs> field_values_;
-  std::vector<const char*> positional_args_;
+  FlagNameIndex field_names_;
+  const std::string& index_cache_dir_;
+
+  std::pmr::vector<FieldArgs> field_values_;
+  std::pmr::vector<const char*> positional_args_;
+  // Descriptor of the last field value, if it's of a sink flag.
+  const OneArgDesc* open_sink_ = nullptr;
+  // false while parsing layers, where sink values of a layer may be dropped.
+  bool eager_sinks_ = true;
+  // Tokens being parsed, i.e. argv or the tokens of a layer, in which errors
+  // are located.
+  const char* const* tokens_ = nullptr;
+  int num_tokens_ = 0;
+  std::pmr::memory_resource* resource_;
+  ParseTracer* tracer_;
 };
 
+// Values of a variable_num_args sink flag are passed to it in batches of this
+// size, bounding the memory used for them.
+constexpr size_t kSinkBatchSize = 1024;
+
 
 Status Parser::PreprocessArgDescList() {
-  for (auto& desc : arg_desc_list_) {
-    for (auto& name : desc.opts.names) {
-      std::string_view name_sv{name};
-      if (field_names_map_.count(name_sv)) {
-        return Status::Error("Field name `") << name_sv
-          << "` declared twice across in "
-          << "argument descriptions. One at " << field_names_map_[name_sv]->filename
-          << " and other one at " << desc.filename;
-      }
-      field_names_map_[name_sv] = &desc;
-    }
+  TraceSpan trace_span(tracer_, "PreprocessArgDescList");
+  auto& build_id = BuildId();
+  if (index_cache_dir_.empty() || build_id.empty()) {
+    return field_names_.Build(0, build_id);
   }
-  return Status::OK;
+  uint64_t registry_hash = 0;
+  {
+    TraceSpan hash_span(tracer_, "RegistryHash");
+    registry_hash = RegistryHash(arg_desc_list_);
+  }
+  char file_name[64];
+  std::snprintf(file_name, sizeof(file_name), "/mflags-%016llx.idx",
+                static_cast<unsigned long long>(registry_hash));
+  std::string path = index_cache_dir_ + file_name;
+  {
+    TraceSpan map_span(tracer_, "MapIndexCache");
+    if (field_names_.Map(path, registry_hash, build_id)) return Status::OK;
+  }
+  auto status = field_names_.Build(registry_hash, build_id);
+  if (status.ok()) field_names_.Save(path);
+  return status;
 }
 
 template<typename T>
-auto SliceVector(const std::vector<T>& v, size_t start, size_t len) {
-  return std::vector<T>(v.begin() + std::min(v.size(), start), v.begin() + std::min(v.size(), start + len));
+auto SliceVector(const std::pmr::vector<T>& v, size_t start, size_t len) {
+  return std::pmr::vector<T>(v.begin() + std::min(v.size(), start), v.begin() + std::min(v.size(), start + len), v.get_allocator());
 }
 
 template<typename T>
-auto SliceVector(const std::vector<T>& v, size_t start) {
-  return std::vector<T>(v.begin() + std::min(v.size(), start), v.end());
+auto SliceVector(const std::pmr::vector<T>& v, size_t start) {
+  return std::pmr::vector<T>(v.begin() + std::min(v.size(), start), v.end(), v.get_allocator());
+}
+
+int Parser::TokenIndex(const char* token) const {
+  for (int i = 0; i < num_tokens_; i++) {
+    if (tokens_[i] == token) return i;
+  }
+  return -1;
+}
+
+Status Parser::Locate(Status status, const OneArgDesc* arg_desc,
+                      const FieldArgs& field_args) const {
+  // The offending token, or else the flag token, which is also the one of a
+  // `--flag=value` arg.
+  int token_index = status.token() ? TokenIndex(status.token()) : -1;
+  if (token_index < 0) token_index = TokenIndex(field_args.field_name.data());
+  status.SetLocation(static_cast<int>(arg_desc - arg_desc_list_.data()),
+                     token_index);
+  // field_args.field_name is in a token. Refer to the same name of the
+  // descriptor instead, which outlives the parse.
+  for (auto& name : arg_desc->opts.names) {
+    if (name == field_args.field_name) status.SetFieldName(name);
+  }
+  return status;
 }
 
 Status Parser::ParsePositionalArgs() {
+  TraceSpan trace_span(tracer_, "ParsePositionalArgs");
   size_t positional_args_offset = 0;
   for (auto& arg : arg_desc_list_) {
     if (!arg.opts.positional) continue;
-    auto name = (arg.opts.names.size() > 0 ? arg.opts.names[0]: "");
+    std::string_view name;
+    if (arg.opts.names.size() > 0) name = arg.opts.names[0];
+    FieldArgs field_args{name, std::pmr::vector<const char*>(resource_)};
     if (arg.variable_num_args) {
-      auto status = arg.parse_func({"Positional " + name, SliceVector(positional_args_, positional_args_offset)});
-      if (!status.ok()) return status;
+      field_args.args = SliceVector(positional_args_, positional_args_offset);
       positional_args_offset = positional_args_.size();
     } else {
-      auto args = SliceVector(positional_args_, positional_args_offset, arg.num_needed_args);
-      if (args.size() == 0 && arg.opts.required) {
-        return Status::Error("Required positional arg ") << name << " not found.";
-      }
-      if (args.size() > 0) {
-        auto status = arg.parse_func({"Positional " + name, args});
-        if (!status.ok()) return status;
-        positional_args_offset += arg.num_needed_args;
+      field_args.args = SliceVector(positional_args_, positional_args_offset, arg.num_needed_args);
+      if (field_args.args.size() == 0 && arg.opts.required) {
+        auto status = Status::MissingPositional(name);
+        status.SetLocation(static_cast<int>(&arg - arg_desc_list_.data()), -1);
+        return status;
       }
+      if (field_args.args.size() == 0) continue;
+      positional_args_offset += arg.num_needed_args;
+    }
+    TraceSpan parse_func_span(tracer_, "parse_func", name);
+    auto status = arg.parse_func(field_args);
+    if (!status.ok()) {
+      status.SetFieldPrefix("Positional ");
+      status.SetLocation(static_cast<int>(&arg - arg_desc_list_.data()),
+                         status.token() ? TokenIndex(status.token()) : -1);
+      return status;
     }
   }
-  auto remaining_args = SliceVector(positional_args_, positional_args_offset);
-  if (remaining_args.size() > 0) {
-    return Status::Error("Unrecognized param: ") << mflags_impl::StrJoin(remaining_args, " ");
+  if (positional_args_offset < positional_args_.size()) {
+    auto status = Status::UnrecognizedParam(
+        positional_args_.data() + positional_args_offset,
+        static_cast<int>(positional_args_.size() - positional_args_offset));
+    status.SetLocation(-1, TokenIndex(positional_args_[positional_args_offset]));
+    return status;
   }
   return Status::OK;
 }
 
 
-Status Parser::ParseFlags(int argc, const char* const* argv,
-                          std::vector<OneArgDesc> arg_desc_list) {
-  arg_desc_list_ = std::move(arg_desc_list);
+Status Parser::ParseFlags(int argc, const char* const* argv) {
+  TraceSpan trace_span(tracer_, "ParseFlags");
   auto result = PreprocessArgDescList();
   if (!result.ok()) return result;
-  CreateFieldValues(argc, argv);
+  tokens_ = argv;
+  num_tokens_ = argc;
+  result = CreateFieldValues(std::max(argc - 1, 0), argv + 1);
+  if (!result.ok()) return result;
   for (auto& item: field_values_) {
-    auto& arg_desc = field_names_map_.at(item.field_name);
+    auto arg_desc = field_names_.Find(item.field_name);
+    TraceSpan parse_func_span(tracer_, "parse_func", item.field_name);
     result = arg_desc->parse_func(item);
-    if (!result.ok()) return result;
+    if (!result.ok()) return Locate(std::move(result), arg_desc, item);
   }
   result = ParsePositionalArgs();
   if (!result.ok()) return result;
@@ -125,19 +698,131 @@ Status Parser::ParseFlags(int argc, const char* const* argv,
 }
 
 
-void Parser::CreateFieldValues(int argc, const char* const* argv) {
+FieldArgs& Parser::AddFieldValue(std::string_view name) {
+  return field_values_.emplace_back(
+      FieldArgs{name, std::pmr::vector<const char*>(resource_)});
+}
+
+Status Parser::FlushSinkField(bool close) {
+  if (open_sink_ == nullptr) return Status::OK;
+  auto& item = field_values_.back();
+  TraceSpan parse_func_span(tracer_, "parse_func", item.field_name);
+  auto status = open_sink_->parse_func(item);
+  if (!status.ok()) status = Locate(std::move(status), open_sink_, item);
+  if (close) {
+    field_values_.pop_back();
+    open_sink_ = nullptr;
+  } else {
+    item.args.clear();
+  }
+  return status;
+}
+
+Status Parser::ParseLayers(const std::vector<FlagLayer>& layers,
+                           std::vector<std::string>* sources) {
+  TraceSpan trace_span(tracer_, "ParseLayers");
+  auto result = PreprocessArgDescList();
+  if (!result.ok()) return result;
+  eager_sinks_ = false;
+  // Start of every layer in field_values_ and positional_args_.
+  std::vector<size_t> field_starts, positional_starts;
+  for (auto& layer : layers) {
+    field_starts.push_back(field_values_.size());
+    positional_starts.push_back(positional_args_.size());
+    tokens_ = layer.tokens.data();
+    num_tokens_ = static_cast<int>(layer.tokens.size());
+    result = CreateFieldValues(num_tokens_, tokens_);
+    if (!result.ok()) return result.WithContext(layer.name);
+  }
+  field_starts.push_back(field_values_.size());
+  positional_starts.push_back(positional_args_.size());
+
+  // For every flag: Its last field value, and the first one to convert.
+  struct Selection {
+    size_t first = 0, last = 0, layer = 0;
+    bool found = false;
+  };
+  std::vector<Selection> selections(arg_desc_list_.size());
+  for (size_t layer = 0; layer < layers.size(); layer++) {
+    for (size_t i = field_starts[layer]; i < field_starts[layer + 1]; i++) {
+      auto arg_desc = field_names_.Find(field_values_[i].field_name);
+      auto& selection = selections[arg_desc - arg_desc_list_.data()];
+      if (!selection.found ||
+          (selection.layer != layer && !arg_desc->opts.merge_layers)) {
+        selection.first = i;
+      }
+      selection.last = i;
+      selection.layer = layer;
+      selection.found = true;
+    }
+  }
+  sources->assign(arg_desc_list_.size(), std::string());
+  for (size_t i = 0; i < field_values_.size(); i++) {
+    auto arg_desc = field_names_.Find(field_values_[i].field_name);
+    size_t index = arg_desc - arg_desc_list_.data();
+    auto& selection = selections[index];
+    bool selected = arg_desc->accumulates ?
+        (i >= selection.first && i <= selection.last) : i == selection.last;
+    // Overridden values aren't converted, so aren't validated either.
+    if (!selected) continue;
+    TraceSpan parse_func_span(tracer_, "parse_func",
+                              field_values_[i].field_name);
+    result = arg_desc->parse_func(field_values_[i]);
+    if (!result.ok()) {
+      size_t layer = std::upper_bound(field_starts.begin(), field_starts.end(),
+                                      i) - field_starts.begin() - 1;
+      tokens_ = layers[layer].tokens.data();
+      num_tokens_ = static_cast<int>(layers[layer].tokens.size());
+      result = Locate(std::move(result), arg_desc, field_values_[i]);
+      return result.WithContext(layers[layer].name);
+    }
+    if (selected) (*sources)[index] = layers[selection.layer].name;
+  }
+
+  // Layer of the positional args, layers.size() if no layer has any.
+  size_t positional_layer = layers.size();
+  for (size_t layer = layers.size(); layer > 0; layer--) {
+    if (positional_starts[layer] > positional_starts[layer - 1]) {
+      positional_layer = layer - 1;
+      tokens_ = layers[positional_layer].tokens.data();
+      num_tokens_ = static_cast<int>(layers[positional_layer].tokens.size());
+      positional_args_ = SliceVector(positional_args_,
+          positional_starts[layer - 1],
+          positional_starts[layer] - positional_starts[layer - 1]);
+      break;
+    }
+  }
+  result = ParsePositionalArgs();
+  if (result.ok()) return result;
+  // Formatted now, as the error may refer to tokens owned by the layers.
+  if (positional_layer == layers.size()) {
+    result.FormatText();
+    return result;
+  }
+  return result.WithContext(layers[positional_layer].name);
+}
+
+Status Parser::CreateFieldValues(int argc, const char* const* argv) {
+  TraceSpan trace_span(tracer_, "CreateFieldValues");
   int num_needed_optional_args = 0;
-  for (int i = 1; i < argc; ++i) {
+  for (int i = 0; i < argc; ++i) {
     std::string_view arg = argv[i];
     std::string_view first, second;
-    if (SplitOnEqual(arg, first, second) && field_names_map_.count(first)) {
-      field_values_.push_back({first, {second.data()}});
+    const OneArgDesc* arg_desc = nullptr;
+    if (SplitOnEqual(arg, first, second) &&
+        (arg_desc = field_names_.Find(first)) != nullptr) {
+      auto status = FlushSinkField(true);
+      if (!status.ok()) return status;
+      AddFieldValue(first).args.push_back(second.data());
+      open_sink_ = arg_desc->is_sink && eager_sinks_ ? arg_desc : nullptr;
       num_needed_optional_args = 0;
       continue;
     }
-    if (field_names_map_.count(arg)) {
-      auto& arg_desc = field_names_map_.at(arg);
-      field_values_.push_back({arg, {}});
+    if ((arg_desc = field_names_.Find(arg)) != nullptr) {
+      auto status = FlushSinkField(true);
+      if (!status.ok()) return status;
+      AddFieldValue(arg);
+      open_sink_ = arg_desc->is_sink && eager_sinks_ ? arg_desc : nullptr;
       if (arg_desc->variable_num_args) {
         num_needed_optional_args = std::numeric_limits<int>::max();
         continue;
@@ -156,14 +841,44 @@ void Parser::CreateFieldValues(int argc, const char* const* argv) {
     if (num_needed_optional_args > 0) {
       field_values_.back().args.push_back(argv[i]);
       num_needed_optional_args--;
+      if (open_sink_ && open_sink_->variable_num_args &&
+          field_values_.back().args.size() == kSinkBatchSize) {
+        auto status = FlushSinkField(false);
+        if (!status.ok()) return status;
+      }
     } else {
       positional_args_.push_back(argv[i]);
     }
   }
+  return FlushSinkField(true);
 }
 
 } // namespace
 
+std::string ParseTracer::ChromeTraceJson() const {
+  std::string output = "{\"traceEvents\":[";
+  char buffer[128];
+  for (size_t i = 0; i < spans_.size(); i++) {
+    auto& span = spans_[i];
+    output += (i > 0 ? ",\n" : "\n");
+    output += "{\"name\":";
+    AppendJsonString(span.name, output);
+    std::snprintf(buffer, sizeof(buffer),
+                  ",\"cat\":\"mflags\",\"ph\":\"X\",\"ts\":%.3f,"
+                  "\"dur\":%.3f,\"pid\":0,\"tid\":0",
+                  span.start_ns / 1000.0, span.duration_ns / 1000.0);
+    output += buffer;
+    if (!span.field_name.empty()) {
+      output += ",\"args\":{\"field\":";
+      AppendJsonString(span.field_name, output);
+      output += "}";
+    }
+    output += "}";
+  }
+  output += "\n]}\n";
+  return output;
+}
+
 std::string mflags_impl::ValueString(int num_needed_args) {
   std::ostringstream oss;
   for (int i = 0; i < num_needed_args; i++) {
@@ -178,11 +893,18 @@ ArgsDescriptor::ArgsDescriptor(std::string help_text)
   AddArg({
     .names={"-h", "--help"},
     .help_text="Show this help message and exit"}, &help_opt_);
-  AddArgList(mflags_impl::GlobalArgDescList());
+  mflags_impl::AppendGlobalArgDescs(arg_desc_list_);
 }
 
 void ArgsDescriptor::ParseFlags(int argc, const char* const* argv) const {
-  auto status = ParseFlagsInternal(argc, argv);
+  ExitOnParseResult(ParseFlagsInternal(argc, argv));
+}
+
+void ArgsDescriptor::ParseLayers(const std::vector<FlagLayer>& layers) {
+  ExitOnParseResult(ParseLayersInternal(layers));
+}
+
+void ArgsDescriptor::ExitOnParseResult(const Status& status) const {
   if (help_opt_) {
     std::cerr << FullHelpText() << std::endl;
     std::exit(0);
@@ -248,18 +970,603 @@ void ParseFlags(int argc, const char* const* argv) {
 }
 
 Status ArgsDescriptor::ParseFlagsInternal(
-      int argc, const char* const* argv) const {
-  return Parser().ParseFlags(argc, argv, DescList());
+      int argc, const char* const* argv,
+      std::pmr::memory_resource* resource) const {
+  auto status = Parser(DescList(), tracer_, index_cache_dir_, resource)
+      .ParseFlags(argc, argv);
+  status.CopyTokens();
+  return status;
 }
 
 Status ArgsDescriptor::ParseFlagsInternal(
-      const std::vector<const char*>& argv) const {
-  return ParseFlagsInternal(static_cast<int>(argv.size()), argv.data());
+      const std::vector<const char*>& argv,
+      std::pmr::memory_resource* resource) const {
+  return ParseFlagsInternal(static_cast<int>(argv.size()), argv.data(),
+                            resource);
+}
+
+Status ArgsDescriptor::ParseLayersInternal(
+      const std::vector<FlagLayer>& layers) {
+  auto status = Parser(DescList(), tracer_, index_cache_dir_,
+                       std::pmr::get_default_resource()).ParseLayers(
+      layers, &flag_sources_);
+  status.CopyTokens();
+  return status;
+}
+
+const std::string& ArgsDescriptor::FlagSource(std::string_view name) const {
+  static const std::string default_source = "default";
+  for (size_t i = 0; i < flag_sources_.size(); i++) {
+    for (auto& flag_name : arg_desc_list_[i].opts.names) {
+      if (flag_name == name) {
+        return flag_sources_[i].empty() ? default_source : flag_sources_[i];
+      }
+    }
+  }
+  return default_source;
+}
+
+FlagLayer FlagLayer::FromArgv(std::string name, int argc,
+                              const char* const* argv) {
+  FlagLayer layer{.name = std::move(name)};
+  if (argc > 1) layer.tokens.assign(argv + 1, argv + argc);
+  return layer;
+}
+
+Status FlagLayer::FromFlagfile(const std::string& path, FlagLayer* output) {
+  std::ifstream file(path);
+  if (!file) return Status::Error("Can't read flagfile ") << path;
+  std::ostringstream oss;
+  oss << file.rdbuf();
+  auto storage = std::make_shared<std::string>(oss.str());
+  // Tokens are NUL terminated in place in @storage.
+  std::string& text = *storage;
+  std::vector<size_t> starts;
+  size_t i = 0;
+  while (i < text.size()) {
+    if (text[i] == '#') {
+      while (i < text.size() && text[i] != '\n') text[i++] = '\0';
+    } else if (std::isspace(static_cast<unsigned char>(text[i]))) {
+      text[i++] = '\0';
+    } else {
+      starts.push_back(i);
+      while (i < text.size() && !std::isspace(static_cast<unsigned char>(text[i]))) {
+        i++;
+      }
+    }
+  }
+  output->name = path;
+  output->tokens.clear();
+  for (auto start : starts) output->tokens.push_back(text.c_str() + start);
+  output->storage = std::move(storage);
+  return Status::OK;
+}
+
+FlagLayer FlagLayer::FromEnv(std::string_view prefix,
+                             const ArgsDescriptor& args_desc) {
+  FlagLayer layer{.name = "env"};
+  std::string storage;
+  std::vector<size_t> starts;
+  for (auto& desc : args_desc.DescList()) {
+    if (desc.opts.positional) continue;
+    for (auto& name : desc.opts.names) {
+      std::string env_name(prefix);
+      size_t start = std::min(name.find_first_not_of('-'), name.size());
+      for (char c : name.substr(start)) {
+        env_name += (c == '-') ? '_' :
+            static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+      }
+      const char* value = std::getenv(env_name.c_str());
+      if (value == nullptr) continue;
+      starts.push_back(storage.size());
+      storage += name + "=" + value;
+      storage += '\0';
+    }
+  }
+  auto shared_storage = std::make_shared<const std::string>(std::move(storage));
+  for (auto start : starts) {
+    layer.tokens.push_back(shared_storage->c_str() + start);
+  }
+  layer.storage = std::move(shared_storage);
+  return layer;
+}
+
+bool mflags_impl::ParseIntegerPrefix(std::string_view str, int64_t& number,
+                                     std::string_view& suffix) {
+  // std::from_chars doesn't accept a leading '+'.
+  if (!str.empty() && str[0] == '+') {
+    str.remove_prefix(1);
+    if (!str.empty() && str[0] == '-') return false;
+  }
+  auto end = str.data() + str.size();
+  auto result = std::from_chars(str.data(), end, number);
+  if (result.ec != std::errc()) return false;
+  suffix = std::string_view(result.ptr, end - result.ptr);
+  return true;
+}
+
+bool mflags_impl::ParseRangeSpec(std::string_view str, RangeSpec& output) {
+  int64_t first = 0, second = 0;
+  std::string_view suffix;
+  if (!ParseIntegerPrefix(str, first, suffix)) return false;
+  if (suffix.empty()) {
+    output = {first, 0, 1};
+    return true;
+  }
+  if (suffix[0] == '*') {
+    if (!ParseIntegerPrefix(suffix.substr(1), second, suffix) ||
+        !suffix.empty() || second < 0) {
+      return false;
+    }
+    output = {first, 0, static_cast<uint64_t>(second)};
+    return true;
+  }
+  if (suffix.substr(0, 2) != ".." ||
+      !ParseIntegerPrefix(suffix.substr(2), second, suffix)) {
+    return false;
+  }
+  int64_t step = second >= first ? 1 : -1;
+  if (!suffix.empty() &&
+      (suffix[0] != ':' || !ParseIntegerPrefix(suffix.substr(1), step, suffix) ||
+       !suffix.empty())) {
+    return false;
+  }
+  if (step == 0 || (second > first && step < 0) ||
+      (second < first && step > 0)) {
+    return false;
+  }
+  // Unsigned, as the distance may not fit in int64_t.
+  uint64_t distance = second >= first
+      ? static_cast<uint64_t>(second) - static_cast<uint64_t>(first)
+      : static_cast<uint64_t>(first) - static_cast<uint64_t>(second);
+  uint64_t abs_step = step > 0 ? static_cast<uint64_t>(step)
+                               : -static_cast<uint64_t>(step);
+  output = {first, step, distance / abs_step + 1};
+  return true;
+}
+
+namespace {
+
+// Value i of @spec, computed unsigned as it may overflow midway.
+int64_t RangeSpecValue(const mflags_impl::RangeSpec& spec, uint64_t i) {
+  return static_cast<int64_t>(static_cast<uint64_t>(spec.first) +
+                              i * static_cast<uint64_t>(spec.step));
+}
+
+bool FitsInt(int64_t value) {
+  return value >= std::numeric_limits<int>::min() &&
+         value <= std::numeric_limits<int>::max();
+}
+
+// Whether @count more values fit next to @current ones, at most @max_values.
+bool FitsRangeLimit(uint64_t current, uint64_t count, uint64_t max_values) {
+  return current <= max_values && count <= max_values - current;
+}
+
+}  // namespace
+
+namespace {
+
+template<typename VectorT>
+Status ParseIntRangesInto(const FieldArgs& field_args, uint64_t max_values,
+                          VectorT& output) {
+  using mflags_impl::RangeSpec;
+  std::pmr::vector<RangeSpec> specs(field_args.args.size(),
+                                    field_args.args.get_allocator());
+  uint64_t total_count = output.size();
+  for (size_t i = 0; i < specs.size(); i++) {
+    auto& spec = specs[i];
+    // A range of ints has at most 2^32 values, so the last value can't
+    // overflow int64_t below.
+    if (!mflags_impl::ParseRangeSpec(field_args.args[i], spec) ||
+        !FitsInt(spec.first) ||
+        (spec.count > 0 && (spec.count - 1 > 0xffffffffull ||
+                            !FitsInt(RangeSpecValue(spec, spec.count - 1)))) ||
+        !FitsRangeLimit(total_count, spec.count, max_values)) {
+      return Status::InvalidValue(field_args.field_name, field_args.args[i],
+                                  &mflags_impl::TypeStr<int>);
+    }
+    total_count += spec.count;
+  }
+  output.reserve(total_count);
+  for (auto& spec : specs) {
+    int64_t value = spec.first;
+    for (uint64_t i = 0; i < spec.count; i++, value += spec.step) {
+      output.push_back(static_cast<int>(value));
+    }
+  }
+  return Status::OK;
+}
+
+}  // namespace
+
+Status mflags_impl::ParseIntRangesVector(const FieldArgs& field_args,
+                                         uint64_t max_values,
+                                         std::vector<int>& output) {
+  return ParseIntRangesInto(field_args, max_values, output);
+}
+
+Status mflags_impl::ParseIntRangesVector(const FieldArgs& field_args,
+                                         uint64_t max_values,
+                                         std::pmr::vector<int>& output) {
+  return ParseIntRangesInto(field_args, max_values, output);
+}
+
+Status mflags_impl::ParseIntervalSet(const FieldArgs& field_args,
+                                     uint64_t max_values,
+                                     IntervalSet& output) {
+  std::pmr::vector<IntervalSet::Interval> intervals(
+      field_args.args.get_allocator());
+  for (auto& arg : field_args.args) {
+    RangeSpec spec;
+    bool valid = ParseRangeSpec(arg, spec);
+    bool is_dense = spec.step >= -1 && spec.step <= 1;
+    uint64_t num_intervals = output.intervals().size() + intervals.size();
+    if (!valid || !FitsRangeLimit(num_intervals, is_dense ? 1 : spec.count,
+                                  max_values)) {
+      return Status::InvalidValue(field_args.field_name, arg,
+                                  &TypeStr<IntervalSet>);
+    }
+    if (spec.count == 0) continue;
+    if (is_dense) {
+      int64_t last = RangeSpecValue(spec, spec.count - 1);
+      intervals.emplace_back(std::min(spec.first, last),
+                             std::max(spec.first, last));
+    } else {
+      for (uint64_t i = 0; i < spec.count; i++) {
+        int64_t value = RangeSpecValue(spec, i);
+        intervals.emplace_back(value, value);
+      }
+    }
+  }
+  output.AddAll(intervals.data(), intervals.size());
+  return Status::OK;
+}
+
+void IntervalSet::Add(int64_t first, int64_t last) {
+  AddAll({{first, last}});
+}
+
+void IntervalSet::AddAll(std::vector<Interval> intervals) {
+  AddAll(intervals.data(), intervals.size());
+}
+
+void IntervalSet::AddAll(Interval* intervals, size_t count) {
+  if (count == 0) return;
+  std::sort(intervals, intervals + count);
+  std::vector<Interval> merged;
+  merged.reserve(intervals_.size() + count);
+  auto add = [&merged](const Interval& interval) {
+    if (interval.first > interval.second) return;
+    if (!merged.empty() &&
+        (interval.first <= merged.back().second ||
+         interval.first - 1 == merged.back().second)) {
+      merged.back().second = std::max(merged.back().second, interval.second);
+    } else {
+      merged.push_back(interval);
+    }
+  };
+  // Both are sorted, so are merged in order.
+  size_t i = 0, j = 0;
+  while (i < intervals_.size() || j < count) {
+    if (j == count || (i < intervals_.size() && intervals_[i] < intervals[j])) {
+      add(intervals_[i++]);
+    } else {
+      add(intervals[j++]);
+    }
+  }
+  intervals_.swap(merged);
+}
+
+bool IntervalSet::Contains(int64_t value) const {
+  auto it = std::upper_bound(
+      intervals_.begin(), intervals_.end(), value,
+      [](int64_t value, const Interval& interval) {
+        return value < interval.first;
+      });
+  return it != intervals_.begin() && std::prev(it)->second >= value;
+}
+
+uint64_t IntervalSet::size() const {
+  uint64_t size = 0;
+  for (auto& interval : intervals_) {
+    size += static_cast<uint64_t>(interval.second) -
+            static_cast<uint64_t>(interval.first) + 1;
+  }
+  return size;
+}
+
+std::string mflags_impl::ToString(const IntervalSet& x) {
+  std::string output = "{";
+  for (auto& interval : x.intervals()) {
+    if (output.size() > 1) output += ", ";
+    output += std::to_string(interval.first);
+    if (interval.second != interval.first) {
+      output += ".." + std::to_string(interval.second);
+    }
+  }
+  return output + "}";
+}
+
+namespace {
+
+struct ByteUnit {
+  std::string_view suffix;
+  uint64_t multiplier;
+};
+
+// Binary units come first, so that ToString prefers them.
+constexpr ByteUnit kByteUnits[] = {
+  {"TiB", 1ull << 40}, {"GiB", 1ull << 30}, {"MiB", 1ull << 20},
+  {"KiB", 1ull << 10}, {"TB", 1000ull * 1000 * 1000 * 1000},
+  {"GB", 1000ull * 1000 * 1000}, {"MB", 1000ull * 1000}, {"KB", 1000},
+  {"B", 1}};
+
+}  // namespace
+
+bool FlagTraits<ByteSize>::Parse(std::string_view str, ByteSize& output) {
+  if (!str.empty() && str[0] == '+') str.remove_prefix(1);
+  uint64_t number = 0;
+  auto end = str.data() + str.size();
+  auto result = std::from_chars(str.data(), end, number);
+  if (result.ec != std::errc()) return false;
+  std::string_view suffix(result.ptr, end - result.ptr);
+  uint64_t multiplier = suffix.empty() ? 1 : 0;
+  for (auto& unit : kByteUnits) {
+    if (unit.suffix == suffix) multiplier = unit.multiplier;
+  }
+  if (multiplier == 0) return false;
+  if (number > std::numeric_limits<uint64_t>::max() / multiplier) return false;
+  output = ByteSize(number * multiplier);
+  return true;
+}
+
+std::string FlagTraits<ByteSize>::ToString(const ByteSize& value) {
+  for (auto& unit : kByteUnits) {
+    if (value.bytes != 0 && value.bytes % unit.multiplier == 0) {
+      return std::to_string(value.bytes / unit.multiplier) +
+             std::string(unit.suffix);
+    }
+  }
+  return std::to_string(value.bytes);
+}
+
+namespace {
+
+// Constant initialized, so it's ready before any global flag registers itself.
+struct GlobalFlagList {
+  std::mutex mutex;
+  mflags_impl::GlobalFlagNode* head = nullptr;
+  mflags_impl::GlobalFlagNode* tail = nullptr;
+  // Last node materialized by AppendGlobalArgDescs.
+  mflags_impl::GlobalFlagNode* materialized_tail = nullptr;
+};
+MFLAGS_CONSTINIT GlobalFlagList g_global_flag_list;
+
+}  // namespace
+
+void mflags_impl::RegisterGlobalFlag(GlobalFlagNode* node) {
+  auto& list = g_global_flag_list;
+  std::lock_guard<std::mutex> lock(list.mutex);
+  (list.head == nullptr ? list.head : list.tail->next) = node;
+  list.tail = node;
+}
+
+void mflags_impl::AppendGlobalArgDescs(std::vector<OneArgDesc>& output) {
+  auto& list = g_global_flag_list;
+  std::lock_guard<std::mutex> lock(list.mutex);
+  static std::vector<OneArgDesc> arg_descs;
+  // Materializes the nodes registered since the last call.
+  if (list.materialized_tail != list.tail) {
+    auto node = list.materialized_tail ? list.materialized_tail->next
+                                       : list.head;
+    for (; node; node = node->next) {
+      arg_descs.push_back(node->make_arg_desc(*node));
+    }
+    list.materialized_tail = list.tail;
+  }
+  output.insert(output.end(), arg_descs.begin(), arg_descs.end());
+}
+
+FlagRegistry::FlagRegistry(const ArgsDescriptor& args_desc) {
+  for (auto& desc : args_desc.DescList()) {
+    if (desc.opts.positional || !desc.value_str_func) continue;
+    entries_.push_back({&desc, desc.value_key_func(desc.bound_variable)});
+  }
+  for (size_t i = 0; i < entries_.size(); i++) {
+    changed_entries_.push_back(i);
+    for (auto& name : entries_[i].desc->opts.names) entry_index_[name] = i;
+  }
+}
+
+const FlagRegistry::Entry* FlagRegistry::FindEntry(
+    std::string_view name) const {
+  auto it = entry_index_.find(name);
+  return it == entry_index_.end() ? nullptr : &entries_[it->second];
+}
+
+std::unique_lock<std::mutex> FlagRegistry::LockValues() const {
+  if (value_mutex_ == nullptr) return std::unique_lock<std::mutex>();
+  return std::unique_lock<std::mutex>(*value_mutex_);
+}
+
+namespace {
+
+const std::string& InitialValueStr(const OneArgDesc& desc) {
+  return desc.default_value_str.empty() ? desc.initial_value_str
+                                        : desc.default_value_str;
+}
+
+}  // namespace
+
+std::optional<std::string> FlagRegistry::GetFlagValueString(
+    std::string_view name) const {
+  auto entry = FindEntry(name);
+  if (entry == nullptr) return std::nullopt;
+  auto lock = LockValues();
+  return entry->desc->value_str_func(entry->desc->bound_variable);
+}
+
+std::optional<bool> FlagRegistry::IsDefault(std::string_view name) const {
+  auto entry = FindEntry(name);
+  if (entry == nullptr) return std::nullopt;
+  auto lock = LockValues();
+  return entry->desc->value_key_func(entry->desc->bound_variable) ==
+         entry->initial_value_key;
+}
+
+bool FlagRegistry::MarkChanged(std::string_view name) {
+  auto it = entry_index_.find(name);
+  if (it == entry_index_.end()) return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!entries_[it->second].changed) {
+    entries_[it->second].changed = true;
+    changed_entries_.push_back(it->second);
+  }
+  generation_++;
+  return true;
+}
+
+void FlagRegistry::MarkAllChanged() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (!entries_[i].changed) changed_entries_.push_back(i);
+    entries_[i].changed = true;
+  }
+  generation_++;
+}
+
+uint64_t FlagRegistry::generation() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return generation_;
+}
+
+namespace {
+
+// Stable 64-bit hash of a non-default flag value: FNV-1a of the name and the
+// value key, finalized with the splitmix64 mixer.
+uint64_t FlagValueHash(std::string_view name, std::string_view value) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto add_bytes = [&](std::string_view bytes) {
+    for (char c : bytes) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+  };
+  add_bytes(name);
+  add_bytes(std::string_view("\0", 1));
+  add_bytes(value);
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
+}
+
+}  // namespace
+
+void FlagRegistry::UpdateChangedEntries() {
+  auto lock = LockValues();
+  for (auto i : changed_entries_) {
+    auto& entry = entries_[i];
+    auto& desc = *entry.desc;
+    auto value = desc.value_str_func(desc.bound_variable);
+    auto& initial_value = InitialValueStr(desc);
+    auto value_key = desc.value_key_func(desc.bound_variable);
+    bool is_default = value_key == entry.initial_value_key;
+    auto& name = desc.opts.names[0];
+    entry.text = name + "=" + value;
+    if (!is_default) entry.text += " (default: " + initial_value + ")";
+    entry.text += "\n";
+    entry.json = "{\"name\":";
+    AppendJsonString(name, entry.json);
+    entry.json += ",\"type\":";
+    AppendJsonString(desc.type_string, entry.json);
+    entry.json += ",\"value\":";
+    AppendJsonString(value, entry.json);
+    entry.json += ",\"default\":";
+    AppendJsonString(initial_value, entry.json);
+    entry.json += is_default ? ",\"is_default\":true}" :
+                               ",\"is_default\":false}";
+    fingerprint_ -= entry.hash;
+    entry.hash = is_default ? 0 : FlagValueHash(name, value_key);
+    fingerprint_ += entry.hash;
+    entry.changed = false;
+  }
+  changed_entries_.clear();
+}
+
+void FlagRegistry::Refresh() {
+  if (dump_generation_ == generation_) return;
+  UpdateChangedEntries();
+  std::string text, json = "[";
+  for (auto& entry : entries_) {
+    text += entry.text;
+    json += (json.size() > 1 ? ",\n" : "\n");
+    json += entry.json;
+  }
+  json += "\n]\n";
+  text_dump_ = std::make_shared<const std::string>(std::move(text));
+  json_dump_ = std::make_shared<const std::string>(std::move(json));
+  dump_generation_ = generation_;
+}
+
+uint64_t FlagRegistry::Fingerprint() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  UpdateChangedEntries();
+  return fingerprint_;
+}
+
+uint64_t FlagRegistry::Fingerprint(
+    const std::function<bool(const OneArgDesc&)>& filter) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  UpdateChangedEntries();
+  uint64_t fingerprint = 0;
+  for (auto& entry : entries_) {
+    if (filter(*entry.desc)) fingerprint += entry.hash;
+  }
+  return fingerprint;
+}
+
+std::shared_ptr<const std::string> FlagRegistry::TextDump() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refresh();
+  return text_dump_;
+}
+
+std::shared_ptr<const std::string> FlagRegistry::JsonDump() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Refresh();
+  return json_dump_;
+}
+
+namespace {
+
+struct FlagOverride {
+  const void* flag;
+  const void* value;
+};
+
+// ScopedFlagOverride of the current thread, innermost last.
+thread_local std::vector<FlagOverride> t_flag_overrides;
+
+}  // namespace
+
+const void* mflags_impl::FindFlagOverride(const void* flag) {
+  for (auto it = t_flag_overrides.rbegin(); it != t_flag_overrides.rend();
+       ++it) {
+    if (it->flag == flag) return it->value;
+  }
+  return nullptr;
+}
+
+void mflags_impl::PushFlagOverride(const void* flag, const void* value) {
+  t_flag_overrides.push_back({flag, value});
+  t_num_flag_overrides++;
 }
 
-std::vector<OneArgDesc>& mflags_impl::GlobalArgDescList() {
-  static std::vector<OneArgDesc> s;
-  return s;
+void mflags_impl::PopFlagOverride([[maybe_unused]] const void* value) {
+  assert(!t_flag_overrides.empty() && t_flag_overrides.back().value == value &&
+         "ScopedFlagOverride destroyed out of order");
+  t_num_flag_overrides--;
+  t_flag_overrides.pop_back();
 }
 
 }  // namespace mflags
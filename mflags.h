@@ -14,12 +14,46 @@
 #include <sstream>
 #include <optional>
 #include <cassert>
+#include <initializer_list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <tuple>
+#include <utility>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <algorithm>
+#include <cctype>
 
 namespace mflags {
 
+// Kind of a Status error, so that callers can react to an error without
+// matching its text.
+enum class ErrorCode : uint8_t {
+  kOk,
+  // Free-form message of Status::Error.
+  kMessage,
+  // A token isn't parsable as the type of its flag.
+  kInvalidValue,
+  // Wrong number of tokens for a flag.
+  kInvalidNumArgs,
+  // Tokens matching neither a flag nor a positional arg.
+  kUnrecognizedParam,
+  // A required positional arg is missing.
+  kMissingPositional,
+};
+
 struct Status {
+  using TypeNameFunc = std::string (*)();
   static constexpr struct TypeOk {} OK = {};
   static constexpr struct TypeError {} ERROR = {};
+  // Part of a `key=value` token of a map flag which isn't parsable.
+  enum class MapEntryPart : uint8_t { kEntry, kKey, kValue };
   Status(TypeOk) { } // Implicitly convertiable from Status::OK
   Status(const Status&) = delete;
   Status(Status& other): Status(std::move(other)) { }
@@ -28,15 +62,92 @@ struct Status {
   Status& operator=(Status&&) = default;
   Status& operator=(Status& other) { return *this = std::move(other); }
   static Status Error(std::string e="") { return Status(Status::ERROR, e); }
-  constexpr bool ok() const { return !error.has_value(); }
+
+  // Structured errors, which don't allocate. Their text is formatted only by
+  // str(). @field_name and @token are referred to, so they must outlive the
+  // Status, or CopyTokens() be called for the tokens. ArgsDescriptor points
+  // @field_name at its own flag names, and copies the tokens, before returning
+  // a Status. @tuple_type_name is set if the flag is a tuple of @type_name
+  // elements.
+  static Status InvalidValue(std::string_view field_name, const char* token,
+                             TypeNameFunc type_name,
+                             TypeNameFunc tuple_type_name = nullptr);
+  static Status InvalidNumArgs(std::string_view field_name, size_t expected,
+                               size_t found, TypeNameFunc type_name,
+                               bool is_tuple = false);
+  // @token isn't `key=value` for kEntry, with @type_name the map type, or its
+  // key or value isn't parsable as @type_name.
+  static Status InvalidMapEntry(std::string_view field_name, const char* token,
+                                MapEntryPart part, TypeNameFunc type_name);
+  // The @num_tokens @tokens, of which the first kMaxUnrecognizedTokens are
+  // referred to, and the others only counted.
+  static constexpr int kMaxUnrecognizedTokens = 4;
+  static Status UnrecognizedParam(const char* const* tokens, int num_tokens);
+  static Status MissingPositional(std::string_view name);
+
+  constexpr bool ok() const { return code_ == ErrorCode::kOk; }
   constexpr operator bool() const { return ok(); }
-  std::string str() const { return ok() ? "" : error->str(); }
+  ErrorCode code() const { return code_; }
+  // Index in ArgsDescriptor::DescList() of the flag, and index in argv (or in
+  // FlagLayer::tokens for ParseLayers) of the token, which caused the error.
+  // -1 if unknown.
+  int flag_index() const { return flag_index_; }
+  int token_index() const { return token_index_; }
+  // The token which isn't parsable, for kInvalidValue.
+  const char* token() const {
+    if (!tokens_copied_) return token_;
+    return code_ == ErrorCode::kInvalidValue ? token_copy_.c_str() : nullptr;
+  }
+  void SetLocation(int flag_index, int token_index) {
+    flag_index_ = flag_index;
+    token_index_ = token_index;
+  }
+  // Text before the field name in the message, e.g. "Positional ".
+  void SetFieldPrefix(const char* prefix) { field_prefix_ = prefix; }
+  // Refers to @name, which must outlive the Status, as the field name.
+  void SetFieldName(std::string_view name) { field_name_ = name; }
+  // Copies the tokens referred to into the Status, so that it no longer
+  // refers to them. Tokens of up to 15 bytes in total don't allocate.
+  void CopyTokens();
+  std::string str() const;
+  // Formats the text of a structured error now, so that the Status no longer
+  // refers to field names and tokens.
+  void FormatText() { if (!ok()) Message(); }
+  // Prepends "@context: " to the text, keeping the code and location.
+  Status& WithContext(std::string_view context);
   template<typename T>
-  Status& operator<<(const T& x) { assert(!ok()); *error << x; return *this; }
+  Status& operator<<(const T& x) { assert(!ok()); Message() << x; return *this; }
 
  private:
-  Status(TypeError, std::string e): error{std::in_place} { *error << e; }
-  std::optional<std::ostringstream> error;
+  Status(TypeError, std::string e): code_(ErrorCode::kMessage),
+                                    message_{std::in_place} { *message_ << e; }
+  Status(ErrorCode code, std::string_view field_name)
+      : code_(code), field_name_(field_name) { }
+  // Formats a structured error into message_, to append to it.
+  std::ostringstream& Message();
+  std::string FormatStructured() const;
+  void FormatMapEntryError(std::ostringstream& oss) const;
+
+  ErrorCode code_ = ErrorCode::kOk;
+  bool is_tuple_ = false;
+  bool is_map_entry_ = false;
+  MapEntryPart map_entry_part_ = MapEntryPart::kEntry;
+  int flag_index_ = -1;
+  int token_index_ = -1;
+  size_t expected_ = 0;
+  size_t found_ = 0;
+  std::string_view field_name_;
+  const char* field_prefix_ = "";
+  const char* token_ = nullptr;
+  TypeNameFunc type_name_ = nullptr;
+  TypeNameFunc tuple_type_name_ = nullptr;
+  const char* tokens_[kMaxUnrecognizedTokens] = {};
+  int num_tokens_ = 0;
+  // Set by CopyTokens(), from token_ or the tokens_ joined by spaces.
+  bool tokens_copied_ = false;
+  std::string token_copy_;
+  // Only for free-form errors, and structured ones appended to.
+  std::optional<std::ostringstream> message_;
 };
 
 struct ArgDescOpts {
@@ -45,11 +156,38 @@ struct ArgDescOpts {
   bool required = false;
   std::string help_text;
   bool include_in_help_text = true;
+  // For flags keeping the values of all occurrences (vector, set, map) given
+  // in several layers of ArgsDescriptor::ParseLayers: true to merge the values
+  // of all the layers, false to take the values of the highest layer only.
+  bool merge_layers = false;
+  // For vector<int> flags: Also accept `first..last`, `first..last:step`
+  // ranges and `value*count` repeats, expanded into the vector.
+  bool range_syntax = false;
+  // For range_syntax and IntervalSet flags: Ranges expanding the vector (or
+  // the intervals of the set) beyond this many values are rejected, so that
+  // a short token can't exhaust the memory.
+  uint64_t max_range_values = 1 << 24;
+};
+
+// Options of a flag added by ADD_GLOBAL_MFLAG. Same as ArgDescOpts, but made of
+// string literals only, so that it's constant initialized and registering a
+// global flag doesn't need any heap allocation.
+struct GlobalArgDescOpts {
+  std::initializer_list<const char*> names;
+  bool positional = false;
+  bool required = false;
+  const char* help_text = "";
+  bool include_in_help_text = true;
+  bool merge_layers = false;
+  bool range_syntax = false;
+  uint64_t max_range_values = 1 << 24;
 };
 
 struct FieldArgs {
   std::string_view field_name;
-  std::vector<const char*> args;
+  // Allocated from the memory resource of the parse, which parse_funcs can
+  // use for their temporaries too.
+  std::pmr::vector<const char*> args;
 };
 
 // Descriptor for one argument field.
@@ -59,11 +197,76 @@ struct OneArgDesc {
   const char* filename = "<unknown>";
   int num_needed_args = 1;
   bool is_bool = false;
-  // true only for vector of core types.
+  // true only for vector, set and map of core types, and IntervalSet.
   bool variable_num_args = false;
+  // true for sink flags, whose values are parsed as soon as they are seen.
+  bool is_sink = false;
+  // true if values of all the occurrences are kept, e.g. vector flags, rather
+  // than the last one overwriting the others.
+  bool accumulates = false;
   std::string help_text_left;
   std::string type_string;
   std::string default_value_str;
+  // Value of the bound variable when the flag was added, formatted like
+  // default_value_str. Only set if default_value_str isn't, i.e. for vector,
+  // set and map flags, so that adding a flag formats its value once.
+  std::string initial_value_str;
+  // Formats the current value of @bound_variable, the same way. Not set for
+  // sink flags.
+  const void* bound_variable = nullptr;
+  std::string (*value_str_func)(const void* bound_variable) = nullptr;
+  // Lossless representation (see mflags_impl::AppendValueKey) of the current
+  // value, computed only by a FlagRegistry.
+  std::string (*value_key_func)(const void* bound_variable) = nullptr;
+};
+
+// Customization point for user defined flag value types. Specialize
+// FlagTraits<T> to use T as a flag, or as an element of vector / pair / tuple
+// flags. A specialization provides:
+//
+//   static bool Parse(std::string_view str, T& output);  // false on failure.
+//   static std::string TypeName();                       // Shown in help.
+//   static std::string ToString(const T& value);         // Default value.
+//
+// Parse should not allocate, it is called once per value on the command line.
+template<typename T, typename Enable = void>
+struct FlagTraits;
+
+// Size in bytes, parsed from strings like "512", "4KB", "64MiB" or "1GiB".
+// Decimal units (KB, MB, GB, TB) are powers of 1000 and binary units
+// (KiB, MiB, GiB, TiB) are powers of 1024.
+struct ByteSize {
+  constexpr ByteSize(uint64_t bytes = 0): bytes(bytes) { }
+  constexpr operator uint64_t() const { return bytes; }
+  uint64_t bytes;
+};
+
+// Set of integers kept as sorted disjoint intervals, for flags over large id
+// spaces. As a flag, it takes values like a vector<int> flag with
+// ArgDescOpts::range_syntax, e.g. `--shards 0..4095 5000`, without expanding
+// the ranges.
+class IntervalSet {
+ public:
+  using Interval = std::pair<int64_t, int64_t>;
+
+  // Adds the closed interval [first, last].
+  void Add(int64_t first, int64_t last);
+  // Adds the closed @intervals, in any order, in a single merge.
+  void AddAll(std::vector<Interval> intervals);
+  // Same, sorting the @count @intervals in place.
+  void AddAll(Interval* intervals, size_t count);
+  bool Contains(int64_t value) const;
+  // Number of integers in the set.
+  uint64_t size() const;
+  bool empty() const { return intervals_.empty(); }
+  // Sorted, disjoint and non adjacent.
+  const std::vector<Interval>& intervals() const { return intervals_; }
+  bool operator==(const IntervalSet& other) const {
+    return intervals_ == other.intervals_;
+  }
+
+ private:
+  std::vector<Interval> intervals_;
 };
 
 namespace mflags_impl {
@@ -86,57 +289,159 @@ struct Contains {
   static constexpr bool value = (RankOf<T, TypechainT>::value > 0);
 };
 
-using CoreTypes = Typechain<int, char, bool, std::string, const char*, double>;
+using CoreTypes = Typechain<int, char, bool, std::string, const char*, double,
+                           std::pmr::string>;
 
 template<typename T>
 using IsCoreType = Contains<CoreTypes, T>;
 
+template<typename T, typename = void>
+struct HasFlagTraits : std::false_type { };
+
+template<typename T>
+struct HasFlagTraits<T, std::void_t<decltype(FlagTraits<T>::Parse(
+    std::declval<std::string_view>(), std::declval<T&>()))>> : std::true_type { };
+
+// Core types and the types having a FlagTraits specialization. Everywhere
+// below, "core types" in the shape names means any of these.
+template<typename T>
+using IsValueType = std::bool_constant<
+  IsCoreType<T>::value || HasFlagTraits<T>::value>;
+
 template<typename T> struct IsTupleOfCoreTypes : std::false_type { };
 
 template<typename T1, typename T2>
 struct IsTupleOfCoreTypes<std::pair<T1, T2>> : std::bool_constant<
-  IsCoreType<T1>::value && IsCoreType<T2>::value> { };
+  IsValueType<T1>::value && IsValueType<T2>::value> { };
+
+template<typename... Ts>
+struct IsTupleOfCoreTypes<std::tuple<Ts...>> : std::bool_constant<
+  (sizeof...(Ts) > 0) && (IsValueType<Ts>::value && ...)> { };
 
 template<typename T> struct IsVectorOfCoreTypes : std::false_type { };
 
-template<typename T> 
-struct IsVectorOfCoreTypes<std::vector<T>> : IsCoreType<T> { };
+template<typename T, typename A>
+struct IsVectorOfCoreTypes<std::vector<T, A>> : IsValueType<T> { };
 
 template<typename T> struct IsVectorOfTupleOfCoreTypes : std::false_type { };
 
-template<typename T> 
-struct IsVectorOfTupleOfCoreTypes<std::vector<T>> : IsTupleOfCoreTypes<T> { };
+template<typename T, typename A>
+struct IsVectorOfTupleOfCoreTypes<std::vector<T, A>> : IsTupleOfCoreTypes<T> { };
+
+template<typename T> struct IsOptionalOfCoreTypes : std::false_type { };
+
+template<typename T>
+struct IsOptionalOfCoreTypes<std::optional<T>> : IsValueType<T> { };
+
+template<typename T> struct IsSetOfCoreTypes : std::false_type { };
+
+template<typename T, typename... Ts>
+struct IsSetOfCoreTypes<std::set<T, Ts...>> : IsValueType<T> { };
+
+// Keys are parsed out of `key=value` tokens, so they can't be `const char*`.
+template<typename K, typename V>
+using IsKeyValueOfCoreTypes = std::bool_constant<
+  IsValueType<K>::value && IsValueType<V>::value &&
+  !std::is_same<K, const char*>::value>;
+
+template<typename T> struct IsMapOfCoreTypes : std::false_type { };
+
+template<typename T>
+using IsIntervalSet = std::is_same<T, IntervalSet>;
+
+template<typename K, typename V, typename... Ts>
+struct IsMapOfCoreTypes<std::map<K, V, Ts...>> : IsKeyValueOfCoreTypes<K, V> { };
+
+template<typename K, typename V, typename... Ts>
+struct IsMapOfCoreTypes<std::unordered_map<K, V, Ts...>>
+    : IsKeyValueOfCoreTypes<K, V> { };
 
 template<typename T>
 using IsSupportedType = std::bool_constant<
-  IsCoreType<T>::value || IsVectorOfCoreTypes<T>::value ||
-  IsTupleOfCoreTypes<T>::value || IsVectorOfTupleOfCoreTypes<T>::value>;
+  IsValueType<T>::value || IsVectorOfCoreTypes<T>::value ||
+  IsTupleOfCoreTypes<T>::value || IsVectorOfTupleOfCoreTypes<T>::value ||
+  IsOptionalOfCoreTypes<T>::value || IsSetOfCoreTypes<T>::value ||
+  IsMapOfCoreTypes<T>::value || IsIntervalSet<T>::value>;
 
 
 template< class T >
 using remove_cvref_t = std::remove_cv_t<std::remove_reference_t<T>>;
 
+template<typename T>
+inline std::string TypeStr();
+
 inline std::string TypeStrImpl(int) { return "int"; }
 inline std::string TypeStrImpl(double) { return "double"; }
 inline std::string TypeStrImpl(bool) { return "bool"; }
 inline std::string TypeStrImpl(char) { return "char"; }
 inline std::string TypeStrImpl(std::string) { return "string"; }
+inline std::string TypeStrImpl(std::pmr::string) { return "string"; }
 inline std::string TypeStrImpl(const char*) { return "const char*"; }
+inline std::string TypeStrImpl(IntervalSet) { return "interval_set"; }
 
 template<typename T1, typename T2>
 inline std::string TypeStrImpl(std::pair<T1, T2>) {
-  return "pair<" + TypeStrImpl(T1{}) + ", " + TypeStrImpl(T2{}) + ">";
+  return "pair<" + TypeStr<T1>() + ", " + TypeStr<T2>() + ">";
+}
+
+template<typename T, typename... Ts>
+inline std::string TypeStrImpl(std::tuple<T, Ts...>) {
+  return "tuple<" + (TypeStr<T>() + ... + (", " + TypeStr<Ts>())) + ">";
+}
+
+template<typename T, typename A>
+inline std::string TypeStrImpl(std::vector<T, A>) {
+  return "vector<" + TypeStr<T>() + ">";
 }
 
 template<typename T>
-inline std::string TypeStrImpl(std::vector<T>) {
-  return "vector<" + TypeStrImpl(T{}) + ">";
+inline std::string TypeStrImpl(std::optional<T>) {
+  return "optional<" + TypeStr<T>() + ">";
+}
+
+template<typename T, typename... Ts>
+inline std::string TypeStrImpl(std::set<T, Ts...>) {
+  return "set<" + TypeStr<T>() + ">";
+}
+
+template<typename K, typename V, typename... Ts>
+inline std::string TypeStrImpl(std::map<K, V, Ts...>) {
+  return "map<" + TypeStr<K>() + ", " + TypeStr<V>() + ">";
+}
+
+template<typename K, typename V, typename... Ts>
+inline std::string TypeStrImpl(std::unordered_map<K, V, Ts...>) {
+  return "unordered_map<" + TypeStr<K>() + ", " + TypeStr<V>() + ">";
 }
 
 template<typename T>
-inline std::string TypeStr() { return TypeStrImpl(T{}); }
+inline std::string TypeStr() {
+  if constexpr (HasFlagTraits<T>::value) {
+    return FlagTraits<T>::TypeName();
+  } else {
+    return TypeStrImpl(T{});
+  }
+}
+
+// Intrusive list node of a flag added by ADD_GLOBAL_MFLAG. The nodes are
+// statically allocated, and materialized into OneArgDesc only when an
+// ArgsDescriptor is constructed after their registration.
+struct GlobalFlagNode {
+  GlobalArgDescOpts opts;
+  const char* filename;
+  void* variable;
+  OneArgDesc (*make_arg_desc)(const GlobalFlagNode& node);
+  GlobalFlagNode* next = nullptr;
+};
+
+// Appends @node to the list of global flags. Doesn't allocate. Thread safe, as
+// flags of a library loaded by dlopen register while other threads may run.
+void RegisterGlobalFlag(GlobalFlagNode* node);
 
-std::vector<OneArgDesc>& GlobalArgDescList();
+// Appends the OneArgDesc of all the global flags to @output, in the order of
+// registration. A node is materialized by the first call after it registered,
+// so its default value is the value of its variable at that time.
+void AppendGlobalArgDescs(std::vector<OneArgDesc>& output);
 
 inline bool IsBoolString(const char* str) {
   return (std::string_view(str) == "true" || std::string_view(str) == "false");
@@ -153,6 +458,17 @@ inline bool CstrToCoreTypes(const char* str, bool& output) {
   return true;
 }
 
+// Same as std::string, i.e. a single word after leading whitespace, but
+// assigned in place so that the string keeps its allocator.
+inline bool CstrToCoreTypes(const char* str, std::pmr::string& output) {
+  std::string_view sv(str);
+  auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)); };
+  while (!sv.empty() && is_space(sv.front())) sv.remove_prefix(1);
+  if (sv.empty() || std::any_of(sv.begin(), sv.end(), is_space)) return false;
+  output.assign(sv.data(), sv.size());
+  return true;
+}
+
 inline bool CstrToCoreTypes(const char* str, char& output) {
   std::string_view sv(str);
   if (sv.size() != 1) return false;
@@ -161,13 +477,25 @@ inline bool CstrToCoreTypes(const char* str, char& output) {
 }
 
 template<typename T>
-inline bool CstrToCoreTypes(const char* str, T& output) {
-  std::stringstream ss(str);
-  T tmp;
-  ss >> tmp;
-  bool ok = (!ss.fail()) && ss.eof();
-  if (ok) output = tmp;
-  return ok;
+bool CstrToCoreTypes(const char* str, T& output) {
+  if constexpr (HasFlagTraits<T>::value) {
+    return FlagTraits<T>::Parse(str, output);
+  } else {
+    std::stringstream ss(str);
+    T tmp;
+    ss >> tmp;
+    bool ok = (!ss.fail()) && ss.eof();
+    if (ok) output = tmp;
+    return ok;
+  }
+}
+
+template<typename T>
+inline bool CstrToCoreTypes(const char* str, std::optional<T>& output) {
+  T tmp{};
+  if (!CstrToCoreTypes(str, tmp)) return false;
+  output = std::move(tmp);
+  return true;
 }
 
 template<typename T>
@@ -179,60 +507,184 @@ inline Status ParseCoreTypes(const FieldArgs& field_args, T& output) {
     }
   }
   if (field_args.args.size() != 1) {
-    return Status::Error("Invalid number of args for `") << field_args.field_name
-      << "`. Expected " << 1 << " found " << field_args.args.size() << ". Should be "
-      << "of type " << TypeStr<T>();
+    return Status::InvalidNumArgs(field_args.field_name, 1,
+                                  field_args.args.size(), &TypeStr<T>);
   }
   if (CstrToCoreTypes(field_args.args.at(0), output)) return Status::OK;
-  return Status::Error("Failed to parse `") << field_args.args.at(0) << "` as type "
-    << TypeStr<T>() << " for field " << field_args.field_name;
+  return Status::InvalidValue(field_args.field_name, field_args.args.at(0),
+                              &TypeStr<T>);
 }
 
-template<typename T>
-inline Status ParseCoreTypesVector(const FieldArgs& field_args, std::vector<T>& output) {
+// Converts each arg to T and passes it to @emit, which returns a Status.
+template<typename T, typename EmitT>
+inline Status ParseCoreTypesEach(const FieldArgs& field_args, EmitT&& emit) {
   for (auto& arg: field_args.args) {
     T tmp;
     if (!CstrToCoreTypes(arg, tmp)) {
-      return Status::Error("Failed to parse `") << arg << "` as type "
-        << TypeStr<T>() << " for field " << field_args.field_name;
+      return Status::InvalidValue(field_args.field_name, arg, &TypeStr<T>);
     }
-    output.push_back(tmp);
+    auto status = emit(std::move(tmp));
+    if (!status.ok()) return status;
   }
   return Status::OK;
 }
 
-template<typename T1, typename T2>
-inline Status ParseCoreTypesTuple(const FieldArgs& field_args, std::pair<T1, T2>& output) {
-  auto&& args = field_args.args;
-  auto&& field_name = field_args.field_name;
-  if (args.size() != 2) {
-    return Status::Error("Invalid number of args for `") << field_name
-      << "`. Expected " << 2 << " found " << args.size() << ". Should be "
-      << "parsable for " << TypeStr<std::pair<T1, T2>>();
-  }
-  if (!CstrToCoreTypes(args[0], output.first)) {
-    return Status::Error("Failed to parse `") << args[0] << "` as type "
-      << TypeStr<T1>() << " for field " << field_name
-      << ". Expected args of " << field_name << " to be parsable for "
-      << TypeStr<std::pair<T1, T2>>();
-  }
-  if (!CstrToCoreTypes(args[1], output.second)) {
-    return Status::Error("Failed to parse `") << args[1] << "` as type "
-      << TypeStr<T2>() << " for field " << field_name
-      << ". Expected args of " << field_name << " to be parsable for "
-      << TypeStr<std::pair<T1, T2>>();
+// One value of a flag with range syntax: `value`, `first..last[:step]` or
+// `value*count`, which are the values first + i * step for i < count.
+struct RangeSpec {
+  int64_t first = 0;
+  int64_t step = 0;
+  uint64_t count = 1;
+};
+
+bool ParseRangeSpec(std::string_view str, RangeSpec& output);
+
+// Parses the args of a vector<int> flag with ArgDescOpts::range_syntax. The
+// total size is known before filling @output, which is reserved once. It's
+// at most @max_values (ArgDescOpts::max_range_values).
+Status ParseIntRangesVector(const FieldArgs& field_args, uint64_t max_values,
+                            std::vector<int>& output);
+Status ParseIntRangesVector(const FieldArgs& field_args, uint64_t max_values,
+                            std::pmr::vector<int>& output);
+
+// Vectors taking ArgDescOpts::range_syntax.
+template<typename T>
+struct IsIntRangesVector : std::integral_constant<bool,
+    std::is_same<T, std::vector<int>>::value ||
+    std::is_same<T, std::pmr::vector<int>>::value> { };
+
+// Same for the number of intervals of @output, where a range with a step
+// other than 1 or -1 adds one interval per value.
+Status ParseIntervalSet(const FieldArgs& field_args, uint64_t max_values,
+                        IntervalSet& output);
+
+template<typename T, typename A>
+inline Status ParseCoreTypesVector(const FieldArgs& field_args,
+                                   std::vector<T, A>& output) {
+  if constexpr (std::uses_allocator<T, A>::value) {
+    // Parsed in place, so that the elements get the allocator of @output,
+    // e.g. the strings of a std::pmr::vector<std::pmr::string>.
+    for (auto& arg: field_args.args) {
+      if (!CstrToCoreTypes(arg, output.emplace_back())) {
+        output.pop_back();
+        return Status::InvalidValue(field_args.field_name, arg, &TypeStr<T>);
+      }
+    }
+    return Status::OK;
+  } else {
+    return ParseCoreTypesEach<T>(field_args, [&output](T&& value) -> Status {
+      output.push_back(std::move(value));
+      return Status::OK;
+    });
   }
+}
+
+// Parse a set of primitive types. Values are converted first and then bulk
+// inserted, so that a failure leaves @output untouched.
+template<typename T, typename... Ts>
+inline Status ParseCoreTypesSet(const FieldArgs& field_args,
+                                std::set<T, Ts...>& output) {
+  std::pmr::vector<T> values(field_args.args.get_allocator());
+  values.reserve(field_args.args.size());
+  for (auto& arg: field_args.args) {
+    T tmp;
+    if (!CstrToCoreTypes(arg, tmp)) {
+      return Status::InvalidValue(field_args.field_name, arg, &TypeStr<T>);
+    }
+    values.push_back(std::move(tmp));
+  }
+  output.insert(std::make_move_iterator(values.begin()),
+                std::make_move_iterator(values.end()));
   return Status::OK;
 }
 
+template<typename T, typename = void>
+struct HasReserve : std::false_type { };
+
+template<typename T>
+struct HasReserve<T, std::void_t<decltype(std::declval<T&>().reserve(0))>>
+    : std::true_type { };
+
+// Parse a map of primitive types from `key=value` tokens. A key given again
+// overwrites the earlier value, same as scalar flags given again.
+template<typename MapT>
+inline Status ParseCoreTypesMap(const FieldArgs& field_args, MapT& output) {
+  using K = typename MapT::key_type;
+  using V = typename MapT::mapped_type;
+  std::pmr::vector<std::pair<K, V>> entries(field_args.args.size(),
+                                            field_args.args.get_allocator());
+  std::pmr::string key_buffer(field_args.args.get_allocator());
+  for (size_t i = 0; i < entries.size(); i++) {
+    auto&& arg = field_args.args[i];
+    auto equal_pos = std::string_view(arg).find('=');
+    if (equal_pos == std::string_view::npos) {
+      return Status::InvalidMapEntry(field_args.field_name, arg,
+          Status::MapEntryPart::kEntry, &TypeStr<MapT>);
+    }
+    key_buffer.assign(arg, equal_pos);
+    if (!CstrToCoreTypes(key_buffer.c_str(), entries[i].first)) {
+      return Status::InvalidMapEntry(field_args.field_name, arg,
+          Status::MapEntryPart::kKey, &TypeStr<K>);
+    }
+    if (!CstrToCoreTypes(arg + equal_pos + 1, entries[i].second)) {
+      return Status::InvalidMapEntry(field_args.field_name, arg,
+          Status::MapEntryPart::kValue, &TypeStr<V>);
+    }
+  }
+  if constexpr (HasReserve<MapT>::value) {
+    output.reserve(output.size() + entries.size());
+  }
+  for (auto& entry : entries) {
+    output.insert_or_assign(std::move(entry.first), std::move(entry.second));
+  }
+  return Status::OK;
+}
 
-// Parse a vector of tuple/pair of primitive types.
 template<typename T>
+constexpr int TupleSize = static_cast<int>(std::tuple_size<T>::value);
+
+// Parses I-th element of a tuple/pair. Returns false and fills @status on
+// failure, so that the fold expression in ParseCoreTypesTuple stops early.
+template<size_t I, typename TupleT>
+inline bool ParseTupleElement(const FieldArgs& field_args, TupleT& output,
+                              Status& status) {
+  using ElementType = std::tuple_element_t<I, TupleT>;
+  auto&& arg = field_args.args[I];
+  if (CstrToCoreTypes(arg, std::get<I>(output))) return true;
+  status = Status::InvalidValue(field_args.field_name, arg,
+                                &TypeStr<ElementType>, &TypeStr<TupleT>);
+  return false;
+}
+
+template<typename TupleT, size_t... Is>
+inline Status ParseCoreTypesTupleImpl(const FieldArgs& field_args,
+                                      TupleT& output,
+                                      std::index_sequence<Is...>) {
+  Status status = Status::OK;
+  (ParseTupleElement<Is>(field_args, output, status) && ...);
+  return status;
+}
+
+// Parse a tuple/pair of primitive types.
+template<typename TupleT>
+inline Status ParseCoreTypesTuple(const FieldArgs& field_args, TupleT& output) {
+  auto&& args = field_args.args;
+  if (args.size() != static_cast<size_t>(TupleSize<TupleT>)) {
+    return Status::InvalidNumArgs(field_args.field_name, TupleSize<TupleT>,
+                                  args.size(), &TypeStr<TupleT>, true);
+  }
+  return ParseCoreTypesTupleImpl(
+      field_args, output, std::make_index_sequence<TupleSize<TupleT>>{});
+}
+
+
+// Parse a vector of tuple/pair of primitive types. The new element is parsed
+// in place, and dropped again if parsing fails.
+template<typename T, typename A>
 inline Status ParseCoreTypesTuplesVector(const FieldArgs& field_args,
-                                   std::vector<T>& output) {
-  T tmp;
-  auto status = ParseCoreTypesTuple(field_args, tmp);
-  if (status.ok()) output.push_back(tmp);
+                                   std::vector<T, A>& output) {
+  auto status = ParseCoreTypesTuple(field_args, output.emplace_back());
+  if (!status.ok()) output.pop_back();
   return status;
 }
 
@@ -254,12 +706,21 @@ inline std::string ToString(bool x) { return x ? "true": "false"; }
 inline std::string ToString(const std::string& x) {
   return x.empty() ? std::string("\"\"") : x;
 }
+inline std::string ToString(const std::pmr::string& x) {
+  return ToString(std::string(x.data(), x.size()));
+}
 inline std::string ToString(const char* x) {
   return x ? ToString(std::string(x)): std::string("nullptr");
 }
 
 template<typename T>
-inline std::string ToString(const T& x) { return std::to_string(x); }
+inline std::string ToString(const T& x) {
+  if constexpr (HasFlagTraits<T>::value) {
+    return FlagTraits<T>::ToString(x);
+  } else {
+    return std::to_string(x);
+  }
+}
 
 template<typename T1, typename T2>
 inline std::string ToString(const std::pair<T1, T2>& x) {
@@ -267,59 +728,580 @@ inline std::string ToString(const std::pair<T1, T2>& x) {
 }
 
 template<typename T>
-inline OneArgDesc MakeArgDesc(ArgDescOpts opts, T& bound_variable) {
+inline std::string ToString(const std::optional<T>& x) {
+  return x.has_value() ? ToString(*x) : std::string("nullopt");
+}
+
+template<typename T, typename... Ts>
+inline std::string ToString(const std::tuple<T, Ts...>& x) {
+  return std::apply([](const T& head, const Ts&... tail) {
+    return "(" + (ToString(head) + ... + (", " + ToString(tail))) + ")";
+  }, x);
+}
+
+// Elements of @x joined with ", " between @open and @close.
+template<typename C>
+inline std::string ToStringRange(const C& x, const char* open,
+                                 const char* close) {
+  std::string output = open;
+  for (auto&& item : x) {
+    const typename C::value_type& value = item;
+    if (output.size() > 1) output += ", ";
+    output += ToString(value);
+  }
+  return output + close;
+}
+
+template<typename T, typename A>
+inline std::string ToString(const std::vector<T, A>& x) {
+  return ToStringRange(x, "[", "]");
+}
+
+template<typename T, typename C, typename A>
+inline std::string ToString(const std::set<T, C, A>& x) {
+  return ToStringRange(x, "{", "}");
+}
+
+// Formatted as KEY=VALUE, same as they are parsed.
+template<typename M>
+inline std::string MapToString(const M& x) {
+  std::string output = "{";
+  for (auto& item : x) {
+    if (output.size() > 1) output += ", ";
+    output += ToString(item.first) + "=" + ToString(item.second);
+  }
+  return output + "}";
+}
+
+// Formatted with the range syntax, e.g. {0..4095, 5000}.
+std::string ToString(const IntervalSet& x);
+
+template<typename K, typename V, typename C, typename A>
+inline std::string ToString(const std::map<K, V, C, A>& x) {
+  return MapToString(x);
+}
+
+template<typename K, typename V, typename H, typename E, typename A>
+inline std::string ToString(const std::unordered_map<K, V, H, E, A>& x) {
+  return MapToString(x);
+}
+
+template<typename T>
+std::string ValueStr(const void* bound_variable) {
+  return ToString(*static_cast<const T*>(bound_variable));
+}
+
+template<typename T> struct IsStdOptional : std::false_type { };
+template<typename T> struct IsStdOptional<std::optional<T>> : std::true_type { };
+
+template<typename T> struct IsDuration : std::false_type { };
+template<typename Rep, typename Period>
+struct IsDuration<std::chrono::duration<Rep, Period>> : std::true_type { };
+
+template<typename T> struct IsUnorderedMap : std::false_type { };
+template<typename K, typename V, typename... Ts>
+struct IsUnorderedMap<std::unordered_map<K, V, Ts...>> : std::true_type { };
+
+template<typename T, typename = void>
+struct IsTupleLike : std::false_type { };
+template<typename T>
+struct IsTupleLike<T, std::void_t<decltype(std::tuple_size<T>::value)>>
+    : std::true_type { };
+
+// Appends a lossless binary representation of @x to @output. Unlike ToString,
+// which rounds doubles, distinct values get distinct keys, so they are what
+// FlagRegistry hashes and compares with the initial value.
+template<typename T>
+inline void AppendValueKey(const T& x, std::string& output) {
+  if constexpr (std::is_arithmetic<T>::value || std::is_enum<T>::value) {
+    output.append(reinterpret_cast<const char*>(&x), sizeof(x));
+  } else if constexpr (std::is_same<T, std::string>::value ||
+                       std::is_same<T, std::pmr::string>::value ||
+                       std::is_same<T, std::string_view>::value) {
+    AppendValueKey(static_cast<uint64_t>(x.size()), output);
+    output.append(x.data(), x.size());
+  } else if constexpr (std::is_same<T, const char*>::value) {
+    AppendValueKey(x != nullptr, output);
+    if (x != nullptr) AppendValueKey(std::string_view(x), output);
+  } else if constexpr (IsDuration<T>::value) {
+    AppendValueKey(x.count(), output);
+  } else if constexpr (HasFlagTraits<T>::value) {
+    if constexpr (std::has_unique_object_representations<T>::value) {
+      output.append(reinterpret_cast<const char*>(&x), sizeof(x));
+    } else {
+      AppendValueKey(FlagTraits<T>::ToString(x), output);
+    }
+  } else if constexpr (IsIntervalSet<T>::value) {
+    AppendValueKey(x.intervals(), output);
+  } else if constexpr (IsStdOptional<T>::value) {
+    AppendValueKey(x.has_value(), output);
+    if (x.has_value()) AppendValueKey(*x, output);
+  } else if constexpr (IsTupleLike<T>::value) {
+    std::apply([&output](const auto&... items) {
+      (AppendValueKey(items, output), ...);
+    }, x);
+  } else {
+    // Containers. Entries of unordered maps are sorted, as their order
+    // depends on the insertions.
+    AppendValueKey(static_cast<uint64_t>(x.size()), output);
+    std::vector<std::string> entry_keys;
+    for (auto&& item : x) {
+      const typename T::value_type& value = item;
+      if constexpr (IsUnorderedMap<T>::value) {
+        AppendValueKey(value, entry_keys.emplace_back());
+      } else {
+        AppendValueKey(value, output);
+      }
+    }
+    std::sort(entry_keys.begin(), entry_keys.end());
+    for (auto& entry_key : entry_keys) AppendValueKey(entry_key, output);
+  }
+}
+
+template<typename T>
+std::string ValueKey(const void* bound_variable) {
+  std::string output;
+  AppendValueKey(*static_cast<const T*>(bound_variable), output);
+  return output;
+}
+
+// Converts @field_args into @output, the variable of a flag of type T.
+template<typename T>
+inline Status ParseFlagArgs(const FieldArgs& field_args, bool range_syntax,
+                            uint64_t max_range_values, T& output) {
+  if constexpr (IsValueType<T>::value || IsOptionalOfCoreTypes<T>::value) {
+    return ParseCoreTypes(field_args, output);
+  } else if constexpr (IsTupleOfCoreTypes<T>::value) {
+    return ParseCoreTypesTuple(field_args, output);
+  } else if constexpr (IsVectorOfCoreTypes<T>::value) {
+    if constexpr (IsIntRangesVector<T>::value) {
+      if (range_syntax) {
+        return ParseIntRangesVector(field_args, max_range_values, output);
+      }
+    }
+    return ParseCoreTypesVector(field_args, output);
+  } else if constexpr (IsIntervalSet<T>::value) {
+    return ParseIntervalSet(field_args, max_range_values, output);
+  } else if constexpr (IsSetOfCoreTypes<T>::value) {
+    return ParseCoreTypesSet(field_args, output);
+  } else if constexpr (IsMapOfCoreTypes<T>::value) {
+    return ParseCoreTypesMap(field_args, output);
+  } else if constexpr (IsVectorOfTupleOfCoreTypes<T>::value) {
+    return ParseCoreTypesTuplesVector(field_args, output);
+  }
+}
+
+template<typename T>
+OneArgDesc MakeArgDesc(ArgDescOpts opts, T& bound_variable) {
   using Type = remove_cvref_t<T>;
   static_assert(IsSupportedType<Type>::value, "Unsupported arg data type. "
-      "Only core types, tuple/pair of core types, vector of core types, and "
-      "vector of tuple/pair of core types are supported. Core types include "
-      "int, char, bool, std::string, const char*, double");
+      "Only core types, tuple/pair of core types, vector of core types, "
+      "vector of tuple/pair of core types, optional / set of core types, and "
+      "map / unordered_map of core types are supported. Core types include "
+      "int, char, bool, std::string, std::pmr::string, const char*, double, "
+      "and the types "
+      "having a mflags::FlagTraits specialization");
+  assert(!opts.range_syntax || IsIntRangesVector<Type>::value);
   OneArgDesc output{.opts=opts, .type_string=TypeStr<Type>()};
   auto help_text_left = StrJoin(opts.names, ", ");
-  if constexpr (IsCoreType<Type>::value) {
+  if constexpr (IsValueType<Type>::value) {
     help_text_left += std::is_same<Type, bool>::value ? "": "=VALUE";
     output.default_value_str = ToString(bound_variable);
-    output.parse_func = [&bound_variable](const FieldArgs& field_args) {
-      return ParseCoreTypes(field_args, bound_variable);
-    };
   } else if constexpr (IsTupleOfCoreTypes<Type>::value) {
-    output.num_needed_args = 2;  // TODO: handle tuple as well.
+    output.num_needed_args = TupleSize<Type>;
     output.default_value_str = ToString(bound_variable);
     help_text_left += ValueString(output.num_needed_args);
-    output.parse_func = [&bound_variable](const FieldArgs& field_args) {
-      return ParseCoreTypesTuple(field_args, bound_variable);
-    };
   } else if constexpr (IsVectorOfCoreTypes<Type>::value) {
     output.variable_num_args = true;
     help_text_left += " VALUES...";
-    output.parse_func = [&bound_variable](const FieldArgs& field_args) {
-      return ParseCoreTypesVector(field_args, bound_variable);
-    };
+    if constexpr (IsIntRangesVector<Type>::value) {
+      if (opts.range_syntax) {
+        help_text_left = StrJoin(opts.names, ", ") + " RANGES...";
+      }
+    }
+  } else if constexpr (IsIntervalSet<Type>::value) {
+    output.variable_num_args = true;
+    help_text_left += " RANGES...";
+  } else if constexpr (IsOptionalOfCoreTypes<Type>::value) {
+    help_text_left += "=VALUE";
+    output.default_value_str = ToString(bound_variable);
+  } else if constexpr (IsSetOfCoreTypes<Type>::value) {
+    output.variable_num_args = true;
+    help_text_left += " VALUES...";
+  } else if constexpr (IsMapOfCoreTypes<Type>::value) {
+    output.variable_num_args = true;
+    help_text_left += " KEY=VALUE...";
   } else if constexpr (IsVectorOfTupleOfCoreTypes<Type>::value) {
-    output.num_needed_args = 2;  // TODO: handle tuple as well.
+    output.num_needed_args = TupleSize<typename Type::value_type>;
     help_text_left += ValueString(output.num_needed_args);
     help_text_left = "( " + help_text_left + " )*";
-    output.parse_func = [&bound_variable](const FieldArgs& field_args) {
-      return ParseCoreTypesTuplesVector(field_args, bound_variable);
-    };
   }
+  output.parse_func = [&bound_variable, range_syntax = opts.range_syntax,
+                       max_values = opts.max_range_values](
+      const FieldArgs& field_args) {
+    return ParseFlagArgs(field_args, range_syntax, max_values, bound_variable);
+  };
   output.help_text_left = help_text_left;
   output.is_bool = std::is_same<Type, bool>::value;
+  if (output.default_value_str.empty()) {
+    output.initial_value_str = ToString(bound_variable);
+  }
+  output.bound_variable = &bound_variable;
+  output.value_str_func = &ValueStr<Type>;
+  output.value_key_func = &ValueKey<Type>;
+  output.accumulates = IsVectorOfCoreTypes<Type>::value ||
+    IsVectorOfTupleOfCoreTypes<Type>::value || IsSetOfCoreTypes<Type>::value ||
+    IsMapOfCoreTypes<Type>::value || IsIntervalSet<Type>::value;
   return output;
 }
 
 
 template<typename T>
+OneArgDesc MakeGlobalArgDesc(const GlobalFlagNode& node) {
+  ArgDescOpts opts{
+    .names={node.opts.names.begin(), node.opts.names.end()},
+    .positional=node.opts.positional,
+    .required=node.opts.required,
+    .help_text=node.opts.help_text,
+    .include_in_help_text=node.opts.include_in_help_text,
+    .merge_layers=node.opts.merge_layers,
+    .range_syntax=node.opts.range_syntax,
+    .max_range_values=node.opts.max_range_values};
+  auto arg_desc = MakeArgDesc(std::move(opts), *static_cast<T*>(node.variable));
+  arg_desc.filename = node.filename;
+  return arg_desc;
+}
+
+// Value type of a sink callback, i.e. its only parameter type.
+template<typename F>
+struct SinkValueType : SinkValueType<decltype(&F::operator())> { };
+
+template<typename R, typename A>
+struct SinkValueType<R (*)(A)> { using type = remove_cvref_t<A>; };
+
+template<typename C, typename R, typename A>
+struct SinkValueType<R (C::*)(A)> { using type = remove_cvref_t<A>; };
+
+template<typename C, typename R, typename A>
+struct SinkValueType<R (C::*)(A) const> { using type = remove_cvref_t<A>; };
+
+// Calls @sink, which returns either void or a Status to stop the parse.
+template<typename F, typename T>
+inline Status CallSink(F& sink, T&& value) {
+  if constexpr (std::is_same<decltype(sink(std::forward<T>(value))),
+                             Status>::value) {
+    return sink(std::forward<T>(value));
+  } else {
+    sink(std::forward<T>(value));
+    return Status::OK;
+  }
+}
+
+// Makes the descriptor of a flag that is parsed like a vector of T, but whose
+// elements are passed to @sink one by one instead of being stored.
+template<typename F>
+OneArgDesc MakeSinkArgDesc(ArgDescOpts opts, F sink) {
+  using Type = typename SinkValueType<F>::type;
+  static_assert(IsValueType<Type>::value || IsTupleOfCoreTypes<Type>::value,
+      "Unsupported sink data type. Sink callbacks must take a core type, or "
+      "a tuple/pair of core types");
+  OneArgDesc output{.opts=opts, .type_string=TypeStr<std::vector<Type>>()};
+  auto help_text_left = StrJoin(opts.names, ", ");
+  if constexpr (IsValueType<Type>::value) {
+    output.variable_num_args = true;
+    help_text_left += " VALUES...";
+    output.parse_func = [sink](const FieldArgs& field_args) mutable {
+      return ParseCoreTypesEach<Type>(field_args, [&sink](Type&& value) {
+        return CallSink(sink, std::move(value));
+      });
+    };
+  } else {
+    output.num_needed_args = TupleSize<Type>;
+    help_text_left += ValueString(output.num_needed_args);
+    help_text_left = "( " + help_text_left + " )*";
+    output.parse_func = [sink](const FieldArgs& field_args) mutable {
+      Type value;
+      auto status = ParseCoreTypesTuple(field_args, value);
+      if (!status.ok()) return status;
+      return CallSink(sink, std::move(value));
+    };
+  }
+  output.help_text_left = help_text_left;
+  output.is_sink = true;
+  output.accumulates = true;
+  return output;
+}
+
 class AutoAssign {
  public:
-  AutoAssign(T* variable, const char* filename, ArgDescOpts opts) {
-    auto&& arg_desc = MakeArgDesc(opts, *variable);
-    arg_desc.filename = filename;
-    GlobalArgDescList().push_back(std::move(arg_desc));
+  AutoAssign(GlobalFlagNode* node) { RegisterGlobalFlag(node); }
+};
+
+// Used by ADD_GLOBAL_MFLAG to check at compile time that a node is a constant
+// expression, so that it's constant initialized even without constinit.
+constexpr bool IsConstantFlagNode(const GlobalFlagNode&) { return true; }
+
+// Calls M(Type) for the core type T, and for vector<T>, pair<T, U> and
+// vector<pair<T, U>> for every core type U.
+#define MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, T)                            \
+  M(T) M(std::vector<T>)                                                    \
+  M(std::pair<T, int>) M(std::pair<T, char>) M(std::pair<T, bool>)        \
+  M(std::pair<T, std::string>) M(std::pair<T, const char*>)               \
+  M(std::pair<T, double>)                                                   \
+  M(std::vector<std::pair<T, int>>) M(std::vector<std::pair<T, char>>)    \
+  M(std::vector<std::pair<T, bool>>)                                        \
+  M(std::vector<std::pair<T, std::string>>)                                 \
+  M(std::vector<std::pair<T, const char*>>)                                 \
+  M(std::vector<std::pair<T, double>>)
+
+// Calls M(Type) for every core type, vector / pair / vector of pair of core
+// types. These are instantiated once in mflags.cpp.
+#define MFLAGS_FOR_EACH_CORE_SHAPE(M)                                       \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, int)                                \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, char)                               \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, bool)                               \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, std::string)                        \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, const char*)                        \
+  MFLAGS_FOR_EACH_SHAPE_OF_CORE_TYPE(M, double)
+
+#define MFLAGS_EXTERN_ARG_DESC(...)                                         \
+  extern template OneArgDesc MakeArgDesc(ArgDescOpts, __VA_ARGS__&);        \
+  extern template OneArgDesc MakeGlobalArgDesc<__VA_ARGS__>(                \
+      const GlobalFlagNode&);
+
+MFLAGS_FOR_EACH_CORE_SHAPE(MFLAGS_EXTERN_ARG_DESC)
+
+#undef MFLAGS_EXTERN_ARG_DESC
+
+extern template bool CstrToCoreTypes(const char*, int&);
+extern template bool CstrToCoreTypes(const char*, double&);
+extern template bool CstrToCoreTypes(const char*, std::string&);
+
+// Parses an optionally signed decimal integer at the start of @str into
+// @number, and sets @suffix to the rest of @str.
+bool ParseIntegerPrefix(std::string_view str, int64_t& number,
+                        std::string_view& suffix);
+
+template<typename Period>
+constexpr const char* DurationUnitSuffix() {
+  if (std::is_same<Period, std::nano>::value) return "ns";
+  if (std::is_same<Period, std::micro>::value) return "us";
+  if (std::is_same<Period, std::milli>::value) return "ms";
+  if (std::is_same<Period, std::ratio<1>>::value) return "s";
+  if (std::is_same<Period, std::ratio<60>>::value) return "m";
+  if (std::is_same<Period, std::ratio<3600>>::value) return "h";
+  return "";
+}
+
+// Converts @count of @Unit into @output. Fails if the result overflows or is
+// not exactly representable, e.g. "1500us" into std::chrono::milliseconds.
+template<typename Unit, typename Rep, typename Period>
+inline bool ScaleDuration(int64_t count,
+                          std::chrono::duration<Rep, Period>& output) {
+  using Ratio = std::ratio_divide<Unit, Period>;
+  if constexpr (std::is_floating_point<Rep>::value) {
+    output = std::chrono::duration<Rep, Period>(
+        static_cast<Rep>(count) * Ratio::num / Ratio::den);
+    return true;
+  } else {
+    constexpr int64_t max = std::numeric_limits<int64_t>::max() / Ratio::num;
+    if (count > max || count < -max) return false;
+    int64_t value = count * Ratio::num;
+    if (value % Ratio::den != 0) return false;
+    value /= Ratio::den;
+    if (value > std::numeric_limits<Rep>::max() ||
+        value < std::numeric_limits<Rep>::min()) return false;
+    output = std::chrono::duration<Rep, Period>(static_cast<Rep>(value));
+    return true;
+  }
+}
+
+}  // namespace mflags_impl
+
+// Durations are parsed from an integer with a unit suffix: ns, us, ms, s, m
+// or h, e.g. "250ms". A number without suffix is taken in the unit of the
+// bound duration type.
+template<typename Rep, typename Period>
+struct FlagTraits<std::chrono::duration<Rep, Period>> {
+  using Duration = std::chrono::duration<Rep, Period>;
+
+  static bool Parse(std::string_view str, Duration& output) {
+    using namespace mflags_impl;
+    int64_t count = 0;
+    std::string_view suffix;
+    if (!ParseIntegerPrefix(str, count, suffix)) return false;
+    if (suffix.empty()) return ScaleDuration<Period>(count, output);
+    if (suffix == "ns") return ScaleDuration<std::nano>(count, output);
+    if (suffix == "us") return ScaleDuration<std::micro>(count, output);
+    if (suffix == "ms") return ScaleDuration<std::milli>(count, output);
+    if (suffix == "s") return ScaleDuration<std::ratio<1>>(count, output);
+    if (suffix == "m") return ScaleDuration<std::ratio<60>>(count, output);
+    if (suffix == "h") return ScaleDuration<std::ratio<3600>>(count, output);
+    return false;
   }
+
+  static std::string TypeName() {
+    std::string unit = mflags_impl::DurationUnitSuffix<Period>();
+    return unit.empty() ? "duration" : "duration<" + unit + ">";
+  }
+
+  static std::string ToString(const Duration& value) {
+    return std::to_string(value.count()) +
+           mflags_impl::DurationUnitSuffix<Period>();
+  }
+};
+
+template<>
+struct FlagTraits<ByteSize> {
+  static bool Parse(std::string_view str, ByteSize& output);
+  static std::string TypeName() { return "bytes"; }
+  static std::string ToString(const ByteSize& value);
 };
 
+// Allowed name of a value of the enum E, for EnumFlagTraits.
+template<typename E>
+struct EnumName {
+  std::string_view name;
+  E value;
+};
+
+namespace mflags_impl {
+
+constexpr uint64_t EnumNameHash(std::string_view name, uint64_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+  for (char c : name) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+  }
+  return hash ^ (hash >> 29);
+}
+
+constexpr size_t EnumHashTableSize(size_t num_names) {
+  size_t size = 1;
+  while (size < 2 * num_names) size *= 2;
+  return size;
+}
+
+// Perfect hash of enum names: The name hashed with @seed into @slots gives
+// its index in the names, -1 in the unused slots.
+template<size_t kSize>
+struct EnumHashTable {
+  uint64_t seed = 0;
+  int slots[kSize] = {};
+};
+
+// Finds the first seed hashing @names without collisions. Fails to compile,
+// by throwing in a constant expression, on duplicate names.
+template<size_t kSize, typename E, size_t N>
+constexpr EnumHashTable<kSize> MakeEnumHashTable(const EnumName<E> (&names)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    for (size_t j = i + 1; j < N; j++) {
+      if (names[i].name == names[j].name) throw "Duplicate enum flag name";
+    }
+  }
+  for (uint64_t seed = 0; seed < (1 << 16); seed++) {
+    EnumHashTable<kSize> table{seed, {}};
+    for (auto& slot : table.slots) slot = -1;
+    bool collision = false;
+    for (size_t i = 0; i < N && !collision; i++) {
+      auto& slot = table.slots[EnumNameHash(names[i].name, seed) & (kSize - 1)];
+      collision = slot >= 0;
+      slot = static_cast<int>(i);
+    }
+    if (!collision) return table;
+  }
+  throw "No perfect hash found for the enum flag names";
+}
+
 }  // namespace mflags_impl
 
+// FlagTraits of an enum E having the names @kNames, a constexpr array of
+// EnumName<E>. Names are looked up with a perfect hash built at compile time,
+// i.e. a single hash and string compare, and listed in the help text.
+//
+//   enum class Compression { kNone, kZstd };
+//   constexpr mflags::EnumName<Compression> kCompressionNames[] = {
+//     {"none", Compression::kNone}, {"zstd", Compression::kZstd}};
+//   template<>
+//   struct mflags::FlagTraits<Compression>
+//       : mflags::EnumFlagTraits<Compression, kCompressionNames> { };
+template<typename E, const auto& kNames>
+struct EnumFlagTraits {
+  static constexpr size_t kNumNames = std::size(kNames);
+  static constexpr size_t kTableSize =
+      mflags_impl::EnumHashTableSize(kNumNames);
+  static constexpr auto kTable =
+      mflags_impl::MakeEnumHashTable<kTableSize>(kNames);
+
+  static bool Parse(std::string_view str, E& output) {
+    int index = kTable.slots[mflags_impl::EnumNameHash(str, kTable.seed) &
+                             (kTableSize - 1)];
+    if (index < 0 || kNames[index].name != str) return false;
+    output = kNames[index].value;
+    return true;
+  }
+  static std::string TypeName() {
+    std::string output = "{";
+    for (auto& item : kNames) {
+      if (output.size() > 1) output += "|";
+      output += item.name;
+    }
+    return output + "}";
+  }
+  static std::string ToString(const E& value) {
+    for (auto& item : kNames) {
+      if (item.value == value) return std::string(item.name);
+    }
+    return std::to_string(static_cast<std::underlying_type_t<E>>(value));
+  }
+};
+
+class ArgsDescriptor;
+
+// One source of flag tokens for ArgsDescriptor::ParseLayers, e.g. a flagfile,
+// the environment or argv. Tokens are parsed the same as argv.
+struct FlagLayer {
+  // Reported by ArgsDescriptor::FlagSource.
+  std::string name;
+  std::vector<const char*> tokens;
+  // Owns the token strings, if they aren't owned by the caller (e.g. argv).
+  std::shared_ptr<const std::string> storage;
+
+  // Tokens of @argv, skipping the program name.
+  static FlagLayer FromArgv(std::string name, int argc,
+                            const char* const* argv);
+  // Whitespace separated tokens of the file @path. '#' starts a comment till
+  // the end of line.
+  static Status FromFlagfile(const std::string& path, FlagLayer* output);
+  // `--flag_name=value` for every flag of @args_desc having an environment
+  // variable @prefix + FLAG_NAME, e.g. MYAPP_BATCH_SIZE for --batch_size.
+  static FlagLayer FromEnv(std::string_view prefix,
+                           const ArgsDescriptor& args_desc);
+};
+
+// Records timestamped spans of parsing, for finding where the time of a slow
+// launch goes. Set on an ArgsDescriptor with SetTracer.
+class ParseTracer {
+ public:
+  struct Span {
+    const char* name;
+    // Field whose parse_func was called, empty for other spans.
+    std::string field_name;
+    int64_t start_ns;
+    int64_t duration_ns;
+  };
+
+  void AddSpan(Span span) { spans_.push_back(std::move(span)); }
+  const std::vector<Span>& spans() const { return spans_; }
+  void Clear() { spans_.clear(); }
+
+  // Spans in Chrome trace-event JSON format, viewable in chrome://tracing or
+  // https://ui.perfetto.dev
+  std::string ChromeTraceJson() const;
+
+ private:
+  std::vector<Span> spans_;
+};
+
 // Overall arguments descriptor.
 class ArgsDescriptor {
  public:
@@ -327,38 +1309,240 @@ class ArgsDescriptor {
   ArgsDescriptor(std::string help_text);
   ArgsDescriptor(const ArgsDescriptor&) = delete;
   ArgsDescriptor& operator=(const ArgsDescriptor&) = delete;
-  template<typename T>
+  template<typename T,
+           typename = std::enable_if_t<!std::is_function<T>::value>>
   void AddArg(ArgDescOpts opts, T* bound_variable);
+  // Adds a flag parsed like a vector of the parameter type of @sink, i.e. a
+  // core type or a tuple/pair of core types. Each value is converted and
+  // passed to @sink as soon as the parser sees it, without storing them all.
+  // @sink, a callable or a function pointer, returns void, or a Status to
+  // stop the parse on error.
+  template<typename F, typename = std::enable_if_t<
+      !std::is_pointer<std::decay_t<F>>::value ||
+      std::is_function<std::remove_pointer_t<std::decay_t<F>>>::value>>
+  void AddArg(ArgDescOpts opts, F sink);
   void ParseFlags(int argc, const char* const* argv) const;
-  Status ParseFlagsInternal(int argc, const char* const* argv) const;
-  Status ParseFlagsInternal(const std::vector<const char*>& argv) const;
+  // Allocations of the parse, other than those of the bound variables and of
+  // a returned error, are from @resource. E.g. a whole parse into std::pmr
+  // containers allocated from the same std::pmr::monotonic_buffer_resource.
+  // A returned error holds copies of the offending tokens, so it may outlive
+  // @argv, but it refers to the flag names of this descriptor: It must not
+  // outlive the descriptor, nor an AddArg after the parse, unless its
+  // FormatText() is called first.
+  Status ParseFlagsInternal(int argc, const char* const* argv,
+                            std::pmr::memory_resource* resource =
+                                std::pmr::get_default_resource()) const;
+  Status ParseFlagsInternal(const std::vector<const char*>& argv,
+                            std::pmr::memory_resource* resource =
+                                std::pmr::get_default_resource()) const;
+  // Parses @layers, lowest priority first, e.g. {flagfile, env, argv}, in a
+  // single pass: A flag takes its value from the highest layer setting it,
+  // and flags set in no layer keep their default. Flags keeping all their
+  // values (vector, set, map) take them from the highest layer, or from all
+  // the layers if ArgDescOpts::merge_layers. Positional args are taken from
+  // the highest layer having any.
+  // Only the values taken are converted, so an overridden value isn't
+  // validated, e.g. the `x` of "--ratio x --ratio=0.25". Not const, as it
+  // records the sources of the flags: Not thread safe.
+  void ParseLayers(const std::vector<FlagLayer>& layers);
+  Status ParseLayersInternal(const std::vector<FlagLayer>& layers);
+  // Name of the layer which set the flag @name in the last ParseLayers,
+  // "default" if none did.
+  const std::string& FlagSource(std::string_view name) const;
   const auto& DescList() const { return arg_desc_list_;}
   std::string FullHelpText() const;
+  // Records spans of the following parses in @tracer. nullptr to disable.
+  void SetTracer(ParseTracer* tracer) { tracer_ = tracer; }
+  // Caches the index of the flag names in the existing directory @dir, in a
+  // file keyed by the hash of the flag names. Later processes of the same
+  // binary (same ELF build-id) map it instead of building the index. A
+  // mismatching or corrupt file is rebuilt. @dir must be writable only by
+  // the users running the binary. Empty to disable.
+  void SetIndexCacheDir(std::string dir) { index_cache_dir_ = std::move(dir); }
 
  private:
-  void AddArgList(const std::vector<OneArgDesc>& list) {
-    arg_desc_list_.insert(arg_desc_list_.end(), list.begin(), list.end());
-  }
+  // Prints the help text and exits if asked for, or the error if any.
+  void ExitOnParseResult(const Status& status) const;
 
  private:
   std::string help_text_;
   bool help_opt_ = false;
   std::vector<OneArgDesc> arg_desc_list_;
+  ParseTracer* tracer_ = nullptr;
+  std::string index_cache_dir_;
+  // Layer names of arg_desc_list_, set by ParseLayers. Empty for defaults.
+  std::vector<std::string> flag_sources_;
 };
 
 
-template<typename T>
+template<typename T, typename>
 inline void ArgsDescriptor::AddArg(ArgDescOpts opts, T* bound_variable) {
   arg_desc_list_.push_back(mflags_impl::MakeArgDesc(opts, *bound_variable));
 }
 
+template<typename F, typename>
+inline void ArgsDescriptor::AddArg(ArgDescOpts opts, F sink) {
+  arg_desc_list_.push_back(mflags_impl::MakeSinkArgDesc(opts, std::move(sink)));
+}
+
 void ParseFlags(int argc, const char* const* argv);
 
+// Current values of the flags of an ArgsDescriptor, e.g. for a /flagz status
+// page. Dumps are cached, and re-format only the flags marked changed since
+// the previous dump. Thread safe.
+class FlagRegistry {
+ public:
+  // @args_desc must outlive the registry, and not get new args. The values of
+  // its flags are the defaults IsDefault and Fingerprint compare to, so the
+  // registry is to be created before the flags are parsed.
+  explicit FlagRegistry(const ArgsDescriptor& args_desc);
+  FlagRegistry(const FlagRegistry&) = delete;
+  FlagRegistry& operator=(const FlagRegistry&) = delete;
+
+  // Bound variables are read by this registry with @mutex held, if it isn't
+  // nullptr, e.g. the one of a SharedFlagTable writing them from another
+  // thread. Otherwise they must not be written while the registry is used.
+  void SetValueMutex(std::mutex* mutex) { value_mutex_ = mutex; }
+
+  // Current value of the flag @name, formatted like its default in the help
+  // text. nullopt if there is no flag @name, or it's a sink flag.
+  std::optional<std::string> GetFlagValueString(std::string_view name) const;
+  // Whether the flag @name still has the value it had when the registry was
+  // created.
+  // nullopt if there is no such flag, or it's a sink flag.
+  std::optional<bool> IsDefault(std::string_view name) const;
+
+  // Tells that the flag @name changed after the last dump, e.g. by a
+  // SharedFlagTable given this registry. Returns false if there is no such
+  // flag.
+  bool MarkChanged(std::string_view name);
+  // Tells that any flag may have changed, e.g. after parsing flags again.
+  void MarkAllChanged();
+  // Incremented on every MarkChanged and MarkAllChanged.
+  uint64_t generation() const;
+
+  // `--flag=value` line per flag, with ` (default: value)` after the changed
+  // ones.
+  std::shared_ptr<const std::string> TextDump();
+  // Array of {"name", "type", "value", "default", "is_default"} objects.
+  std::shared_ptr<const std::string> JsonDump();
+
+  // Stable 64-bit fingerprint of the non-default flag values, e.g. to key
+  // caches on the effective configuration. It's the sum of per-flag hashes,
+  // so only the flags marked changed are hashed again.
+  uint64_t Fingerprint();
+  // Fingerprint of the flags passing @filter only, e.g. of the flags whose
+  // OneArgDesc::filename is a given file.
+  uint64_t Fingerprint(const std::function<bool(const OneArgDesc&)>& filter);
+
+ private:
+  struct Entry {
+    const OneArgDesc* desc;
+    // Value key of the flag when the registry was created.
+    std::string initial_value_key;
+    std::string text;
+    std::string json;
+    // FlagValueHash, 0 for a default value.
+    uint64_t hash = 0;
+    bool changed = true;
+  };
+
+  const Entry* FindEntry(std::string_view name) const;
+  // Locks value_mutex_, if set.
+  std::unique_lock<std::mutex> LockValues() const;
+  // Re-formats and re-hashes the changed entries.
+  void UpdateChangedEntries();
+  // Also re-builds the dumps, if anything changed.
+  void Refresh();
+
+  mutable std::mutex mutex_;
+  // Taken after mutex_, when both are needed.
+  std::mutex* value_mutex_ = nullptr;
+  std::vector<Entry> entries_;
+  // All the names of the flags, to index in entries_.
+  std::unordered_map<std::string_view, size_t> entry_index_;
+  // Guarded by mutex_, as are all the following.
+  std::vector<size_t> changed_entries_;
+  uint64_t generation_ = 1;
+  uint64_t dump_generation_ = 0;
+  std::shared_ptr<const std::string> text_dump_;
+  std::shared_ptr<const std::string> json_dump_;
+  uint64_t fingerprint_ = 0;
+};
+
+namespace mflags_impl {
+
+// Number of ScopedFlagOverride alive in the current thread. Defined here, and
+// constant initialized, so that GetFlag reads it without a TLS wrapper call.
+inline thread_local int t_num_flag_overrides = 0;
+
+// Overriding value of @flag in the current thread, nullptr if none.
+const void* FindFlagOverride(const void* flag);
+void PushFlagOverride(const void* flag, const void* value);
+// Pops the innermost override, which must be the one of @value.
+void PopFlagOverride(const void* value);
+
+template<typename T>
+struct TypeIdentity { using type = T; };
+
+}  // namespace mflags_impl
+
+// Value of the global @flag in the current thread: The innermost
+// ScopedFlagOverride of it in this thread, else the flag itself. Costs a
+// thread local load and a branch when the thread has no override.
+template<typename T>
+inline const T& GetFlag(const T& flag) {
+  if (mflags_impl::t_num_flag_overrides == 0) return flag;
+  auto value = mflags_impl::FindFlagOverride(&flag);
+  return value ? *static_cast<const T*>(value) : flag;
+}
+
+// Overrides a global flag, as read by GetFlag, in the current thread only,
+// till the end of the scope. So that tests needing different flag values can
+// run in parallel threads. The flag variable itself isn't modified. Overrides
+// of a thread must end in reverse order, as scopes do.
+//
+//   mflags::ScopedFlagOverride override_x(g_x, 5);
+//   mflags::ScopedFlagOverride override_name(g_name, "test");  // std::string
+template<typename T>
+class ScopedFlagOverride {
+ public:
+  // T is deduced from @flag only, so that @value may be e.g. a string literal.
+  ScopedFlagOverride(const T& flag,
+                     typename mflags_impl::TypeIdentity<T>::type value)
+      : value_(std::move(value)) {
+    mflags_impl::PushFlagOverride(&flag, &value_);
+  }
+  ScopedFlagOverride(const ScopedFlagOverride&) = delete;
+  ScopedFlagOverride& operator=(const ScopedFlagOverride&) = delete;
+  ~ScopedFlagOverride() { mflags_impl::PopFlagOverride(&value_); }
+
+ private:
+  T value_;
+};
+
 }  // namespace mflags
 
-#define ADD_GLOBAL_MFLAG(type, var, default_value, ...)             \
-  type var = default_value;                                         \
-  ::mflags::mflags_impl::AutoAssign<type> AutoAssignVar_ ## var {   \
-      &var, __FILE__, ::mflags::ArgDescOpts(__VA_ARGS__) };
+#if defined(__cpp_constinit)
+#define MFLAGS_CONSTINIT constinit
+#else
+#define MFLAGS_CONSTINIT
+#endif
+
+// The node of a global flag is constant initialized, which C++17 guarantees
+// for an initializer that is a constant expression, as the static_assert
+// checks. It's linked into the list of global flags by the dynamic
+// initializer of AutoAssign, which doesn't allocate.
+#define ADD_GLOBAL_MFLAG(type, var, default_value, ...)                   \
+  type var = default_value;                                               \
+  static_assert(::mflags::mflags_impl::IsConstantFlagNode(                \
+      ::mflags::mflags_impl::GlobalFlagNode{ __VA_ARGS__, __FILE__, &var, \
+          &::mflags::mflags_impl::MakeGlobalArgDesc<type> }),             \
+      "Options of ADD_GLOBAL_MFLAG must be constant, e.g. string literals"); \
+  MFLAGS_CONSTINIT ::mflags::mflags_impl::GlobalFlagNode                  \
+      GlobalFlagNode_ ## var { __VA_ARGS__, __FILE__, &var,               \
+      &::mflags::mflags_impl::MakeGlobalArgDesc<type> };                  \
+  ::mflags::mflags_impl::AutoAssign AutoAssignVar_ ## var {               \
+      &GlobalFlagNode_ ## var };
 
 #endif  // MFLAGS_H
@@ -0,0 +1,406 @@
+#include "mflags_shared.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mflags {
+namespace {
+
+using mflags_impl::SharedFlagSlot;
+using mflags_impl::SharedFlagTableHeader;
+
+constexpr uint64_t kSharedFlagTableMagic = 0x6d666c6167730002;
+
+size_t TableSize(size_t capacity) {
+  return sizeof(SharedFlagTableHeader) + capacity * sizeof(SharedFlagSlot);
+}
+
+int FindArgDesc(const ArgsDescriptor& args_desc, std::string_view name) {
+  auto& desc_list = args_desc.DescList();
+  for (size_t i = 0; i < desc_list.size(); i++) {
+    for (auto& desc_name : desc_list[i].opts.names) {
+      if (desc_name == name) return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+// Makes @sequence odd, which also serves as the lock among the writers.
+// Returns the even value it had.
+uint64_t BeginWrite(std::atomic<uint64_t>& sequence) {
+  uint64_t start = sequence.load(std::memory_order_relaxed);
+  do {
+    while (start & 1) start = sequence.load(std::memory_order_relaxed);
+  } while (!sequence.compare_exchange_weak(start, start + 1,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed));
+  std::atomic_thread_fence(std::memory_order_release);
+  return start;
+}
+
+}  // namespace
+
+void mflags_impl::SharedFlagSlot::Write(const void* input) {
+  uint64_t buffer[mflags_impl::kSharedFlagValueWords] = {};
+  std::memcpy(buffer, input, size);
+  uint64_t start = BeginWrite(sequence);
+  for (size_t i = 0; i < mflags_impl::kSharedFlagValueWords; i++) {
+    words[i].store(buffer[i], std::memory_order_relaxed);
+  }
+  sequence.store(start + 2, std::memory_order_release);
+}
+
+SharedFlagTable::SharedFlagTable(const ArgsDescriptor& args_desc)
+    : args_desc_(args_desc) { }
+
+SharedFlagTable::~SharedFlagTable() {
+  if (header_ != nullptr) munmap(header_, mapped_size_);
+}
+
+Status SharedFlagTable::Map(int fd, size_t size) {
+  if (header_ != nullptr) {
+    return Status::Error("Shared flag table is already mapped");
+  }
+  void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    return Status::Error("Failed to map shared flag table: ")
+      << std::strerror(errno);
+  }
+  header_ = static_cast<SharedFlagTableHeader*>(address);
+  slots_ = reinterpret_cast<SharedFlagSlot*>(header_ + 1);
+  mapped_size_ = size;
+  return Status::OK;
+}
+
+Status SharedFlagTable::Create(int fd, int capacity) {
+  if (capacity <= 0) {
+    return Status::Error("Invalid shared flag table capacity ") << capacity;
+  }
+  size_t size = TableSize(capacity);
+  if (ftruncate(fd, size) != 0) {
+    return Status::Error("Failed to size shared flag table: ")
+      << std::strerror(errno);
+  }
+  auto status = Map(fd, size);
+  if (!status.ok()) return status;
+  std::memset(static_cast<void*>(header_), 0, size);
+  new (header_) SharedFlagTableHeader{kSharedFlagTableMagic,
+      static_cast<uint32_t>(capacity), 0, {0}, {0}};
+  for (int i = 0; i < capacity; i++) new (&slots_[i]) SharedFlagSlot{};
+  is_owner_ = true;
+  return Status::OK;
+}
+
+Status SharedFlagTable::Attach(int fd) {
+  struct stat file_stat {};
+  if (fstat(fd, &file_stat) != 0) {
+    return Status::Error("Failed to stat shared flag table: ")
+      << std::strerror(errno);
+  }
+  size_t size = file_stat.st_size;
+  if (size < sizeof(SharedFlagTableHeader)) {
+    return Status::Error("Not a shared flag table");
+  }
+  auto status = Map(fd, size);
+  if (!status.ok()) return status;
+  if (header_->magic != kSharedFlagTableMagic ||
+      TableSize(header_->capacity) != size) {
+    munmap(header_, mapped_size_);
+    header_ = nullptr;
+    return Status::Error("Not a shared flag table");
+  }
+  is_owner_ = false;
+  return Status::OK;
+}
+
+SharedFlagSlot* SharedFlagTable::AddSlot(std::string_view name,
+                                         void* bound_variable,
+                                         size_t size) {
+  if (header_ == nullptr || name.size() >= mflags_impl::kSharedFlagNameSize) {
+    return nullptr;
+  }
+  SharedFlagSlot* slot = nullptr;
+  for (uint32_t i = 0; i < header_->num_slots; i++) {
+    if (name == slots_[i].name && size == slots_[i].size) slot = &slots_[i];
+  }
+  if (slot == nullptr) {
+    if (!is_owner_ || header_->num_slots == header_->capacity) return nullptr;
+    slot = &slots_[header_->num_slots];
+    std::memcpy(slot->name, name.data(), name.size());
+    slot->size = static_cast<uint32_t>(size);
+    slot->Write(bound_variable);
+    header_->num_slots++;
+  }
+  local_flags_.push_back({std::string(name), FindArgDesc(args_desc_, name),
+                          bound_variable, slot});
+  return slot;
+}
+
+Status SharedFlagTable::Set(std::string_view name, const char* value) {
+  return SetBatch({{std::string(name), value}});
+}
+
+Status SharedFlagTable::SetBatch(
+    const std::vector<std::pair<std::string, std::string>>& updates) {
+  // Values of the bound variables before the update, restored if it fails.
+  struct SavedValue {
+    LocalFlag* local_flag;
+    uint64_t words[mflags_impl::kSharedFlagValueWords];
+  };
+  std::unique_lock<std::mutex> lock(set_mutex_);
+  std::vector<SavedValue> saved_values;
+  Status status = Status::OK;
+  for (auto& [name, value] : updates) {
+    LocalFlag* local_flag = nullptr;
+    for (auto& item : local_flags_) {
+      if (item.name == name) local_flag = &item;
+    }
+    if (local_flag == nullptr) {
+      status = Status::Error("Flag `") << name
+        << "` is not in the shared flag table";
+      break;
+    }
+    if (local_flag->arg_desc_index < 0) {
+      status = Status::Error("Flag `") << name
+        << "` is not in the args descriptor";
+      break;
+    }
+    saved_values.push_back({local_flag, {}});
+    std::memcpy(saved_values.back().words, local_flag->bound_variable,
+                local_flag->slot->size);
+    auto& arg_desc = args_desc_.DescList()[local_flag->arg_desc_index];
+    status = arg_desc.parse_func({local_flag->name, {value.c_str()}});
+    if (!status.ok()) {
+      // The error refers to @value, which may not outlive this call.
+      status.SetLocation(local_flag->arg_desc_index, -1);
+      status.FormatText();
+      break;
+    }
+  }
+  if (!status.ok()) {
+    for (auto it = saved_values.rbegin(); it != saved_values.rend(); ++it) {
+      std::memcpy(it->local_flag->bound_variable, it->words,
+                  it->local_flag->slot->size);
+    }
+    return status;
+  }
+  uint64_t start = BeginWrite(header_->batch_sequence);
+  for (auto& saved_value : saved_values) {
+    saved_value.local_flag->slot->Write(saved_value.local_flag->bound_variable);
+  }
+  header_->batch_sequence.store(start + 2, std::memory_order_release);
+  header_->generation.fetch_add(1, std::memory_order_release);
+  // Unlocked first, as the registry takes its own lock before set_mutex_.
+  lock.unlock();
+  if (registry_ != nullptr) {
+    for (auto& saved_value : saved_values) {
+      registry_->MarkChanged(saved_value.local_flag->name);
+    }
+  }
+  return Status::OK;
+}
+
+void SharedFlagTable::SetRegistry(FlagRegistry* registry) {
+  if (registry_ != nullptr) registry_->SetValueMutex(nullptr);
+  registry_ = registry;
+  if (registry_ != nullptr) registry_->SetValueMutex(&set_mutex_);
+}
+
+uint64_t SharedFlagTable::generation() const {
+  return header_ ? header_->generation.load(std::memory_order_acquire) : 0;
+}
+
+namespace {
+
+// Identity and version of a file, to tell whether it changed.
+struct FileStamp {
+  ino_t inode = 0;
+  off_t size = -1;
+  timespec mtime = {};
+
+  bool operator==(const FileStamp& other) const {
+    return inode == other.inode && size == other.size &&
+           mtime.tv_sec == other.mtime.tv_sec &&
+           mtime.tv_nsec == other.mtime.tv_nsec;
+  }
+  bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+FileStamp StampOf(const std::string& path) {
+  FileStamp stamp;
+  struct stat file_stat {};
+  if (stat(path.c_str(), &file_stat) == 0) {
+    stamp = {file_stat.st_ino, file_stat.st_size, file_stat.st_mtim};
+  }
+  return stamp;
+}
+
+// `--flag=value` and `--flag value` entries of a flagfile.
+Status FlagfileValues(const std::string& path,
+                      std::map<std::string, std::string>& output) {
+  FlagLayer layer;
+  auto status = FlagLayer::FromFlagfile(path, &layer);
+  if (!status.ok()) return status;
+  for (size_t i = 0; i < layer.tokens.size(); i++) {
+    std::string_view token = layer.tokens[i];
+    auto equal_pos = token.find('=');
+    if (token.empty() || token[0] != '-') {
+      return Status::Error(path) << ": Unexpected value `" << token << "`";
+    } else if (equal_pos != std::string_view::npos) {
+      output[std::string(token.substr(0, equal_pos))] =
+          std::string(token.substr(equal_pos + 1));
+    } else if (i + 1 < layer.tokens.size()) {
+      output[std::string(token)] = layer.tokens[++i];
+    } else {
+      return Status::Error(path) << ": Missing value of `" << token << "`";
+    }
+  }
+  return Status::OK;
+}
+
+// Whether the pending inotify events of @inotify_fd include one of the file
+// @name. Reads all of them.
+bool ReadEventsOf(int inotify_fd, std::string_view name) {
+  alignas(inotify_event) char events[4096];
+  bool found = false;
+  ssize_t size;
+  while ((size = read(inotify_fd, events, sizeof(events))) > 0) {
+    for (ssize_t offset = 0; offset < size;) {
+      auto event = reinterpret_cast<const inotify_event*>(events + offset);
+      if (event->len > 0 && name == event->name) found = true;
+      offset += sizeof(inotify_event) + event->len;
+    }
+  }
+  return found;
+}
+
+// Inotify fd watching the directory of the file @path, -1 if inotify isn't
+// available. The directory is watched, as editors often replace the file by
+// renaming.
+int WatchDirOf(const std::string& path) {
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) return -1;
+  auto slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+      (slash == 0 ? "/" : path.substr(0, slash));
+  if (inotify_add_watch(inotify_fd, dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+    close(inotify_fd);
+    return -1;
+  }
+  return inotify_fd;
+}
+
+// Reloads @watcher on every event of @inotify_fd about the file @path, till
+// @stop_fd gets readable. Without inotify, polls the file and reloads it when
+// it changes from @stamp, which misses a rewrite of the same size within the
+// mtime granularity.
+void WatchFile(FlagfileWatcher* watcher, const std::string& path,
+               int inotify_fd, int stop_fd,
+               std::chrono::milliseconds poll_interval, FileStamp stamp) {
+  auto slash = path.rfind('/');
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  while (true) {
+    pollfd fds[2] = {{stop_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    int num_ready = poll(fds, inotify_fd >= 0 ? 2 : 1,
+                         static_cast<int>(poll_interval.count()));
+    if (num_ready < 0 && errno != EINTR) break;
+    if (fds[0].revents != 0) break;
+    if (inotify_fd >= 0) {
+      if (fds[1].revents != 0 && ReadEventsOf(inotify_fd, name)) {
+        watcher->Reload();
+      }
+      continue;
+    }
+    FileStamp new_stamp = StampOf(path);
+    if (new_stamp == stamp) continue;
+    stamp = new_stamp;
+    watcher->Reload();
+  }
+  if (inotify_fd >= 0) close(inotify_fd);
+}
+
+}  // namespace
+
+FlagfileWatcher::FlagfileWatcher(SharedFlagTable& table, std::string path)
+    : table_(table), path_(std::move(path)) { }
+
+FlagfileWatcher::~FlagfileWatcher() {
+  Stop();
+}
+
+Status FlagfileWatcher::Start(std::chrono::milliseconds poll_interval) {
+  if (thread_.joinable()) return Status::Error("Watcher is already started");
+  // Taken before reading the file, so that a change racing with it is seen.
+  int inotify_fd = WatchDirOf(path_);
+  FileStamp stamp = StampOf(path_);
+  auto status = Reload();
+  if (status.ok() && pipe2(stop_pipe_, O_CLOEXEC) != 0) {
+    status = Status::Error("Failed to create pipe: ") << std::strerror(errno);
+  }
+  if (!status.ok()) {
+    if (inotify_fd >= 0) close(inotify_fd);
+    return status;
+  }
+  thread_ = std::thread(WatchFile, this, path_, inotify_fd, stop_pipe_[0],
+                        poll_interval, stamp);
+  return Status::OK;
+}
+
+void FlagfileWatcher::Stop() {
+  if (!thread_.joinable()) return;
+  char byte = 0;
+  while (write(stop_pipe_[1], &byte, 1) < 0 && errno == EINTR) { }
+  thread_.join();
+  close(stop_pipe_[0]);
+  close(stop_pipe_[1]);
+  stop_pipe_[0] = stop_pipe_[1] = -1;
+}
+
+Status FlagfileWatcher::Reload() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, std::string> values;
+  auto status = FlagfileValues(path_, values);
+  if (status.ok()) {
+    std::vector<std::pair<std::string, std::string>> updates;
+    for (auto& item : values) {
+      auto it = applied_values_.find(item.first);
+      if (it == applied_values_.end() || it->second != item.second) {
+        updates.push_back(item);
+      }
+    }
+    if (!updates.empty()) {
+      status = table_.SetBatch(updates);
+      if (status.ok()) num_applied_++;
+    }
+  }
+  if (!status.ok()) {
+    last_error_ = status.str();
+    return status;
+  }
+  // Flags removed from the file keep their values.
+  for (auto& item : values) applied_values_[item.first] = std::move(item.second);
+  last_error_.clear();
+  return Status::OK;
+}
+
+Status FlagfileWatcher::last_status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (last_error_.empty()) return Status::OK;
+  return Status::Error(last_error_);
+}
+
+uint64_t FlagfileWatcher::num_applied() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_applied_;
+}
+
+}  // namespace mflags
@@ -0,0 +1,257 @@
+// Author: Mohit <mohitsaini1196@gmail.com>
+// Github: https://github.com/mohitmv/mflags
+
+// Shared memory flag table: Runtime-mutable flags shared across processes.
+//
+// A server parses its flags as usual, places the selected flags in a
+// SharedFlagTable backed by a shared memory file (memfd_create / shm_open),
+// and forks its workers. A control process can then update a flag by name,
+// the value being converted by the flag's parse_func. Workers read the latest
+// value through a SharedFlag<T> handle, which is a seqlock protected read of
+// the shared memory, without any syscall or lock.
+//
+// A FlagfileWatcher re-applies a flagfile to the table whenever it changes on
+// disk, so that long running services are reconfigured without a restart.
+//
+//   mflags::SharedFlagTable table{args_desc};
+//   auto status = table.Create(memfd_create("flags", 0), 16);
+//   auto batch_size = table.Add("--batch_size", &g_batch_size);
+//   ... fork workers, which use batch_size.Get() ...
+//   status = table.Set("--batch_size", "64");  // From the control process.
+
+#ifndef MFLAGS_SHARED_H
+#define MFLAGS_SHARED_H
+
+#include "mflags.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace mflags {
+
+namespace mflags_impl {
+
+constexpr size_t kSharedFlagNameSize = 64;
+constexpr size_t kSharedFlagValueWords = 8;
+
+// One flag in the shared memory. Value is stored in atomic words, so that a
+// reader racing with a writer is well defined, and discarded by the seqlock.
+struct SharedFlagSlot {
+  // Odd while a write is in progress.
+  std::atomic<uint64_t> sequence;
+  uint32_t size;
+  char name[kSharedFlagNameSize];
+  std::atomic<uint64_t> words[kSharedFlagValueWords];
+
+  void Read(void* output) const;
+  void Write(const void* input);
+};
+
+struct SharedFlagTableHeader {
+  uint64_t magic;
+  uint32_t capacity;
+  uint32_t num_slots;
+  // Incremented on every update of any flag in the table.
+  std::atomic<uint64_t> generation;
+  // Seqlock of the batches of updates, odd while one is being written.
+  std::atomic<uint64_t> batch_sequence;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared flags need address free atomics");
+
+inline void SharedFlagSlot::Read(void* output) const {
+  uint64_t buffer[kSharedFlagValueWords];
+  size_t num_words = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  while (true) {
+    uint64_t start = sequence.load(std::memory_order_acquire);
+    if (start & 1) continue;
+    for (size_t i = 0; i < num_words; i++) {
+      buffer[i] = words[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence.load(std::memory_order_relaxed) == start) break;
+  }
+  std::memcpy(output, buffer, size);
+}
+
+}  // namespace mflags_impl
+
+// Handle of a flag in a SharedFlagTable. Cheap to copy, and valid as long as
+// the table is mapped, in the process which created it and in its forks.
+template<typename T>
+class SharedFlag {
+ public:
+  SharedFlag() = default;
+  // Latest value of the flag.
+  T Get() const {
+    T value;
+    slot_->Read(&value);
+    return value;
+  }
+  bool valid() const { return slot_ != nullptr; }
+
+ private:
+  friend class SharedFlagTable;
+  explicit SharedFlag(const mflags_impl::SharedFlagSlot* slot): slot_(slot) { }
+  const mflags_impl::SharedFlagSlot* slot_ = nullptr;
+};
+
+class SharedFlagTable {
+ public:
+  // @args_desc provides the parse_func of the flags, used by Set. It must
+  // outlive this table, and not get new args after flags are added here.
+  explicit SharedFlagTable(const ArgsDescriptor& args_desc);
+  SharedFlagTable(const SharedFlagTable&) = delete;
+  SharedFlagTable& operator=(const SharedFlagTable&) = delete;
+  ~SharedFlagTable();
+
+  // Sizes the file @fd for @capacity flags and maps it. Flags are added to
+  // the table only by the process which created it, before forking. The
+  // mapping stays valid after @fd is closed.
+  Status Create(int fd, int capacity);
+
+  // Maps a table created by another process, e.g. to Set flags from a
+  // control process. Flags must still be Add-ed to find their bound variable.
+  Status Attach(int fd);
+
+  // Places the flag @name, bound to @bound_variable, in the table. In the
+  // creating process the slot is initialized with the current value, in an
+  // attached process the existing slot is looked up. Returns an invalid
+  // handle if the table is full, or the flag isn't in an attached table.
+  template<typename T>
+  SharedFlag<T> Add(std::string_view name, T* bound_variable);
+
+  // Converts @value with the parse_func of flag @name, same as if
+  // `name=value` were on the command line, and publishes it to the readers.
+  Status Set(std::string_view name, const char* value);
+
+  // Set of several flags as one update: All the values are converted before
+  // any is published, and nothing is published if any of them fails. Calls
+  // from threads of this process, e.g. of a FlagfileWatcher, are serialized.
+  Status SetBatch(const std::vector<std::pair<std::string, std::string>>&
+                      updates);
+
+  // Calls @read, which reads flags of this table with SharedFlag::Get, till
+  // it runs without overlapping a SetBatch. So the flags read are all from
+  // before or all from after any batch.
+  template<typename F>
+  void ReadConsistent(F&& read) const;
+
+  // Incremented on every Set in any process.
+  uint64_t generation() const;
+
+  // Flags updated by Set in this process are marked changed in @registry,
+  // so that its dumps show them, and @registry reads the bound variables
+  // without racing with Set. nullptr to disable.
+  void SetRegistry(FlagRegistry* registry);
+
+ private:
+  struct LocalFlag {
+    std::string name;
+    // Index in args_desc_.DescList(), -1 if @name isn't found there.
+    int arg_desc_index;
+    void* bound_variable;
+    mflags_impl::SharedFlagSlot* slot;
+  };
+
+  Status Map(int fd, size_t size);
+  mflags_impl::SharedFlagSlot* AddSlot(std::string_view name,
+                                       void* bound_variable, size_t size);
+
+  const ArgsDescriptor& args_desc_;
+  mflags_impl::SharedFlagTableHeader* header_ = nullptr;
+  mflags_impl::SharedFlagSlot* slots_ = nullptr;
+  size_t mapped_size_ = 0;
+  bool is_owner_ = false;
+  std::vector<LocalFlag> local_flags_;
+  FlagRegistry* registry_ = nullptr;
+  // Held by SetBatch, which writes the bound variables, and by registry_
+  // reading them.
+  std::mutex set_mutex_;
+};
+
+template<typename T>
+inline SharedFlag<T> SharedFlagTable::Add(std::string_view name,
+                                          T* bound_variable) {
+  static_assert(std::is_trivially_copyable<T>::value &&
+                sizeof(T) <= sizeof(uint64_t) *
+                             mflags_impl::kSharedFlagValueWords,
+                "Only small trivially copyable flags can be shared");
+  return SharedFlag<T>(AddSlot(name, bound_variable, sizeof(T)));
+}
+
+template<typename F>
+inline void SharedFlagTable::ReadConsistent(F&& read) const {
+  while (true) {
+    uint64_t start = header_->batch_sequence.load(std::memory_order_acquire);
+    if (start & 1) continue;
+    read();
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->batch_sequence.load(std::memory_order_relaxed) == start) break;
+  }
+}
+
+// Watches a flagfile (same format as FlagLayer::FromFlagfile, with
+// `--flag=value` or `--flag value` entries) and applies the flags changed in
+// it to a SharedFlagTable as one SetBatch. Changes are noticed with inotify,
+// or by polling the file if inotify isn't available. An invalid file is
+// rejected as a whole, and the flags keep their last applied values. Replace
+// the file by renaming a new one over it, so a partly written file is never
+// seen.
+//
+// Updates are converted by the parse_func of the flags, so the bound
+// variables are written by the watcher thread. Read the flags through their
+// SharedFlag handles instead.
+class FlagfileWatcher {
+ public:
+  // @table must outlive the watcher.
+  FlagfileWatcher(SharedFlagTable& table, std::string path);
+  FlagfileWatcher(const FlagfileWatcher&) = delete;
+  FlagfileWatcher& operator=(const FlagfileWatcher&) = delete;
+  ~FlagfileWatcher();
+
+  // Applies the file, and starts watching it in a background thread, which
+  // reloads it on every inotify event of the file, or checks it every
+  // @poll_interval if inotify isn't available.
+  Status Start(std::chrono::milliseconds poll_interval =
+                   std::chrono::seconds(1));
+  void Stop();
+
+  // Re-reads the file and applies the flags changed since the last applied
+  // version of it.
+  Status Reload();
+
+  // Result of the last Reload, e.g. the error of a rejected file.
+  Status last_status() const;
+  // Number of batches applied so far.
+  uint64_t num_applied() const;
+
+ private:
+  SharedFlagTable& table_;
+  std::string path_;
+  mutable std::mutex mutex_;
+  // Flag values of the last applied file. Guarded by mutex_, as are the
+  // following two.
+  std::map<std::string, std::string> applied_values_;
+  // Empty if the last Reload succeeded.
+  std::string last_error_;
+  uint64_t num_applied_ = 0;
+  // Written to by Stop, to wake up the watcher thread.
+  int stop_pipe_[2] = {-1, -1};
+  std::thread thread_;
+};
+
+}  // namespace mflags
+
+#endif  // MFLAGS_SHARED_H
@@ -0,0 +1,110 @@
+#include "mflags.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+// Counts the calls of the global operator new, to check that a parse in a
+// memory resource doesn't use the heap.
+static size_t g_num_heap_allocations = 0;
+
+void* operator new(std::size_t size) {
+  g_num_heap_allocations++;
+  if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void TestPmrFlags() {
+  alignas(std::max_align_t) std::byte buffer[32768];
+  std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer),
+                                            std::pmr::null_memory_resource());
+  int shard = 0;
+  std::pmr::string name(&arena);
+  std::pmr::vector<std::pmr::string> tags(&arena);
+  std::pmr::vector<std::pair<int, std::pmr::string>> routes(&arena);
+  mflags::ArgsDescriptor args_desc{};
+  args_desc.AddArg({.names={"--shard"}}, &shard);
+  args_desc.AddArg({.names={"--name"}}, &name);
+  args_desc.AddArg({.names={"--tags"}}, &tags);
+  args_desc.AddArg({.names={"--routes"}}, &routes);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[2].type_string == "string");
+  assert(desc_list[3].type_string == "vector<string>");
+  assert(desc_list[4].type_string == "vector<pair<int, string>>");
+  std::vector<const char*> argv = {
+      "", "--shard", "7", "--name", "a_name_longer_than_small_strings",
+      "--tags", "first_tag_longer_than_small_strings", "b",
+      "--routes", "1", "eu-west-region-longer-than-small-strings",
+      "--routes", "2", "us", "positional"};
+
+  // Parses once on the heap, which also initializes the static state used
+  // by parses, like the build-id.
+  auto status = args_desc.ParseFlagsInternal(argv);
+  assert(status.str() == "Unrecognized param: positional");
+  argv.pop_back();
+  tags.clear();
+  routes.clear();
+  [[maybe_unused]] size_t num_heap_allocations = g_num_heap_allocations;
+  status = args_desc.ParseFlagsInternal(argv, &arena);
+  assert(g_num_heap_allocations == num_heap_allocations);
+  assert(status.ok());
+  assert(shard == 7 && name == "a_name_longer_than_small_strings");
+  assert(tags.size() == 2 && tags[0] == "first_tag_longer_than_small_strings");
+  assert(tags[0].get_allocator().resource() == &arena);
+  assert(routes.size() == 2 && routes[1].first == 2 &&
+         routes[0].second == "eu-west-region-longer-than-small-strings");
+  assert(routes[0].second.get_allocator().resource() == &arena);
+
+  // Same words as std::string flags.
+  status = args_desc.ParseFlagsInternal({"", "--name", " x"});
+  assert(status.ok() && name == "x");
+  status = args_desc.ParseFlagsInternal({"", "--tags", "c", "d e"});
+  assert(status.str() == "Failed to parse `d e` as type string for field "
+                         "--tags");
+  assert(tags.size() == 3 && tags.back() == "c");
+  assert(mflags::mflags_impl::ToString(tags) ==
+         "[first_tag_longer_than_small_strings, b, c]");
+
+  std::cout << "Passed TestPmrFlags" << std::endl;
+}
+
+void TestPmrRanges() {
+  alignas(std::max_align_t) std::byte buffer[16384];
+  std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer),
+                                            std::pmr::null_memory_resource());
+  std::pmr::vector<int> shards(&arena);
+  mflags::IntervalSet ids;
+  mflags::ArgsDescriptor args_desc{};
+  args_desc.AddArg({.names={"--shards"}, .range_syntax=true}, &shards);
+  args_desc.AddArg({.names={"--ids"}}, &ids);
+  assert(args_desc.DescList()[1].help_text_left == "--shards RANGES...");
+  std::vector<const char*> argv = {"", "--shards", "0..3", "2*2"};
+  assert(args_desc.ParseFlagsInternal(argv).ok());
+  shards.clear();
+
+  [[maybe_unused]] size_t num_heap_allocations = g_num_heap_allocations;
+  assert(args_desc.ParseFlagsInternal(argv, &arena).ok());
+  assert(g_num_heap_allocations == num_heap_allocations);
+  assert((shards == std::pmr::vector<int>{0, 1, 2, 3, 2, 2}));
+
+  // The temporary intervals are from the arena, only the set itself is on
+  // the heap.
+  assert(args_desc.ParseFlagsInternal(
+      {"", "--ids", "0..10:2", "100..200", "5"}, &arena).ok());
+  assert(ids.intervals().size() == 6);
+  assert(ids.Contains(150) && ids.Contains(5) && !ids.Contains(7));
+
+  std::cout << "Passed TestPmrRanges" << std::endl;
+}
+
+int main() {
+  TestPmrFlags();
+  TestPmrRanges();
+}
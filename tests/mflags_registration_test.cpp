@@ -0,0 +1,43 @@
+#include "mflags.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// Counts the calls of the global operator new, to check that registering
+// global flags doesn't allocate. In its own binary, as it counts the
+// allocations of the whole program.
+static int g_num_allocations = 0;
+
+void* operator new(std::size_t size) {
+  g_num_allocations++;
+  if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+ADD_GLOBAL_MFLAG(int, g_count, 0,
+    {.names={"--count", "-c"}, .help_text="Number of items"});
+
+ADD_GLOBAL_MFLAG(const char*, g_name, "default_name",
+    {.names={"--name"}, .help_text="Name of the items"});
+
+ADD_GLOBAL_MFLAG(bool, g_verbose, false,
+    {.names={"--verbose"}, .help_text="Log more"});
+
+// Dynamically initialized after all the flags above are registered.
+static int g_num_registration_allocations = g_num_allocations;
+
+int main() {
+  assert(g_num_registration_allocations == 0);
+  // Materialized by the first parse, which allocates.
+  const char* argv[] = {"./a.out", "-c", "3", "--verbose"};
+  mflags::ParseFlags(4, argv);
+  assert(g_count == 3 && g_verbose);
+  assert(g_name == std::string("default_name"));
+  assert(g_num_allocations > 0);
+  std::cout << "Passed TestRegistrationAllocations" << std::endl;
+}
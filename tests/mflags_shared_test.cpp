@@ -0,0 +1,194 @@
+#include "mflags_shared.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void TestSharedFlagTable() {
+  int batch_size = 16;
+  double ratio = 0.5;
+  bool verbose = false;
+  mflags::ArgsDescriptor args_desc{};
+  args_desc.AddArg({.names={"--batch_size"}}, &batch_size);
+  args_desc.AddArg({.names={"--ratio"}}, &ratio);
+  args_desc.AddArg({.names={"--verbose"}}, &verbose);
+  assert(args_desc.ParseFlagsInternal({"", "--batch_size", "32"}).ok());
+
+  int fd = memfd_create("mflags_shared_test", 0);
+  assert(fd >= 0);
+  mflags::SharedFlagTable table{args_desc};
+  assert(table.Create(fd, 2).ok());
+  auto shared_batch_size = table.Add("--batch_size", &batch_size);
+  auto shared_ratio = table.Add("--ratio", &ratio);
+  assert(shared_batch_size.valid() && shared_ratio.valid());
+  assert(!table.Add("--verbose", &verbose).valid());  // Table is full.
+  assert(shared_batch_size.Get() == 32);
+  assert(shared_ratio.Get() == 0.5);
+
+  assert(table.Set("--ratio", "0.25").ok());
+  assert(shared_ratio.Get() == 0.25);
+  assert(table.generation() == 1);
+
+  auto status = table.Set("--batch_size", "abc");
+  assert(status.str() == "Failed to parse `abc` as type int for field "
+                         "--batch_size");
+  assert(shared_batch_size.Get() == 32);
+  status = table.Set("--verbose", "true");
+  assert(status.str() == "Flag `--verbose` is not in the shared flag table");
+
+  // A worker process waits until it sees the value set by a control process.
+  pid_t worker = fork();
+  if (worker == 0) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (shared_batch_size.Get() != 64) {
+      if (std::chrono::steady_clock::now() > deadline) _exit(1);
+    }
+    _exit(shared_ratio.Get() == 0.25 ? 0 : 1);
+  }
+  pid_t control = fork();
+  if (control == 0) {
+    int control_batch_size = 0;
+    bool control_verbose = false;
+    mflags::ArgsDescriptor control_args_desc{};
+    control_args_desc.AddArg({.names={"--batch_size"}}, &control_batch_size);
+    mflags::SharedFlagTable control_table{control_args_desc};
+    if (!control_table.Attach(fd).ok()) _exit(1);
+    if (!control_table.Add("--batch_size", &control_batch_size).valid()) _exit(1);
+    if (control_table.Add("--verbose", &control_verbose).valid()) _exit(1);
+    _exit(control_table.Set("--batch_size", "64").ok() ? 0 : 1);
+  }
+  int worker_status = 0, control_status = 0;
+  waitpid(control, &control_status, 0);
+  waitpid(worker, &worker_status, 0);
+  assert(WIFEXITED(control_status) && WEXITSTATUS(control_status) == 0);
+  assert(WIFEXITED(worker_status) && WEXITSTATUS(worker_status) == 0);
+  assert(shared_batch_size.Get() == 64);
+  assert(table.generation() == 2);
+
+  mflags::SharedFlagTable invalid_table{args_desc};
+  int empty_fd = memfd_create("mflags_shared_test_empty", 0);
+  assert(invalid_table.Attach(empty_fd).str() == "Not a shared flag table");
+  close(empty_fd);
+  close(fd);
+
+  std::cout << "Passed TestSharedFlagTable" << std::endl;
+}
+
+void WriteFile(const std::string& path, const std::string& content) {
+  std::string tmp_path = path + ".tmp";
+  std::ofstream(tmp_path) << content;
+  std::rename(tmp_path.c_str(), path.c_str());
+}
+
+void TestFlagfileWatcher() {
+  int batch_size = 16;
+  double ratio = 0.5;
+  mflags::ArgsDescriptor args_desc{};
+  args_desc.AddArg({.names={"--batch_size"}}, &batch_size);
+  args_desc.AddArg({.names={"--ratio"}}, &ratio);
+  int fd = memfd_create("mflags_shared_test_watcher", 0);
+  mflags::SharedFlagTable table{args_desc};
+  assert(table.Create(fd, 2).ok());
+  auto shared_batch_size = table.Add("--batch_size", &batch_size);
+  auto shared_ratio = table.Add("--ratio", &ratio);
+  mflags::FlagRegistry registry{args_desc};
+  table.SetRegistry(&registry);
+
+  // A batch with an invalid value is rejected as a whole.
+  auto status = table.SetBatch({{"--batch_size", "32"}, {"--ratio", "x"}});
+  assert(status.str() == "Failed to parse `x` as type double for field --ratio");
+  assert(batch_size == 16 && shared_batch_size.Get() == 16);
+  assert(table.SetBatch({{"--batch_size", "32"}, {"--ratio", "2"}}).ok());
+  assert(shared_batch_size.Get() == 32 && shared_ratio.Get() == 2);
+  assert(registry.generation() == 3);
+  assert(registry.TextDump()->find("--ratio=2.000000 (default: 0.500000)") !=
+         std::string::npos);
+
+  char dir[] = "/tmp/mflags_shared_test_XXXXXX";
+  char* dir_path = mkdtemp(dir);
+  assert(dir_path != nullptr);
+  std::string path = std::string(dir_path) + "/flags";
+  WriteFile(path, "--batch_size=64 --ratio 0.25\n");
+  mflags::FlagfileWatcher watcher{table, path};
+  assert(watcher.Start(std::chrono::milliseconds(10)).ok());
+  assert(shared_batch_size.Get() == 64 && shared_ratio.Get() == 0.25);
+  assert(watcher.num_applied() == 1);
+
+  // Readers never see a half applied file: batch_size == 100 * ratio.
+  std::atomic<bool> done{false};
+  std::thread reader([&] {
+    while (!done) {
+      int read_batch_size = 0;
+      double read_ratio = 0;
+      table.ReadConsistent([&] {
+        read_batch_size = shared_batch_size.Get();
+        read_ratio = shared_ratio.Get();
+      });
+      assert(read_batch_size == 64 || read_batch_size == 100 * read_ratio);
+      // The registry reads the bound variables with the lock of the table.
+      assert(registry.GetFlagValueString("--ratio").has_value());
+      assert(!registry.TextDump()->empty());
+    }
+  });
+  // Batches set by another thread, some of them rejected and rolled back,
+  // while the watcher applies the file.
+  std::thread control([&] {
+    while (!done) {
+      assert(table.SetBatch({{"--batch_size", "700"}, {"--ratio", "7"}}).ok());
+      assert(!table.SetBatch({{"--batch_size", "800"}, {"--ratio", "x"}}).ok());
+    }
+  });
+  auto wait_for = [](auto condition) {
+    [[maybe_unused]] auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!condition()) {
+      assert(std::chrono::steady_clock::now() < deadline);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+  for (int i = 1; i <= 5; i++) {
+    WriteFile(path, "--batch_size=" + std::to_string(100 * i) +
+                    "\n--ratio=" + std::to_string(i) + "\n");
+    wait_for([&] { return watcher.num_applied() == 1u + i; });
+  }
+  done = true;
+  reader.join();
+  control.join();
+  assert(watcher.num_applied() == 6);
+  assert(table.SetBatch({{"--batch_size", "500"}, {"--ratio", "5"}}).ok());
+
+  // An invalid file is rejected, and only changed flags are applied.
+  WriteFile(path, "--batch_size=7 --ratio=abc\n");
+  wait_for([&] { return !watcher.last_status().ok(); });
+  assert(shared_batch_size.Get() == 500);
+  WriteFile(path, "--batch_size=500 --ratio=6\n");
+  wait_for([&] { return watcher.last_status().ok(); });
+  assert(shared_ratio.Get() == 6);
+  assert(watcher.num_applied() == 7);
+
+  // Rewritten in place to the same size and mtime, which polling would miss.
+  auto mtime = std::filesystem::last_write_time(path);
+  std::ofstream(path) << "--batch_size=500 --ratio=8\n";
+  std::filesystem::last_write_time(path, mtime);
+  wait_for([&] { return watcher.num_applied() == 8; });
+  assert(shared_ratio.Get() == 8);
+  watcher.Stop();
+  std::remove(path.c_str());
+  rmdir(dir_path);
+  close(fd);
+
+  std::cout << "Passed TestFlagfileWatcher" << std::endl;
+}
+
+int main() {
+  TestSharedFlagTable();
+  TestFlagfileWatcher();
+}
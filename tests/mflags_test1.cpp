@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <cassert>
+#include <thread>
+#include <vector>
 
 ADD_GLOBAL_MFLAG(int, g_x, 0,
     {.names={"--x"}, .help_text="Input value x for blah"});
@@ -18,6 +20,19 @@ ADD_GLOBAL_MFLAG(int, g_p, 0,
 ADD_GLOBAL_MFLAG(bool, g_r, false,
     {.names={"--r"}, .help_text="Input value r for blah"});
 
+ADD_GLOBAL_MFLAG(std::string, g_s, "default_s",
+    {.names={"--s"}, .help_text="Input value s for blah"});
+
+// Registered only by RegisterLateFlag, after the flags above were
+// materialized, like the flags of a library loaded by dlopen.
+int g_late = 0;
+void RegisterLateFlag() {
+  static mflags::mflags_impl::GlobalFlagNode node{
+      {.names={"--late"}}, __FILE__, &g_late,
+      &mflags::mflags_impl::MakeGlobalArgDesc<int>};
+  static mflags::mflags_impl::AutoAssign auto_assign{&node};
+}
+
 int main() {
   {
     std::cout << "===== Test1 ===== " << std::endl;
@@ -46,6 +61,41 @@ int main() {
     assert(g_r);
     std::cout << "===== All Good ===== " << std::endl;
   }
+  {
+    std::cout << "===== Test4 ===== " << std::endl;
+    assert(mflags::GetFlag(g_x) == 4);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back([i] {
+        for (int j = 0; j < 1000; j++) {
+          mflags::ScopedFlagOverride override_x(g_x, i);
+          assert(mflags::GetFlag(g_x) == i);
+          {
+            mflags::ScopedFlagOverride override_x2(g_x, -i);
+            mflags::ScopedFlagOverride override_z(g_z, "thread_z");
+            mflags::ScopedFlagOverride override_s(g_s, "thread_s");
+            assert(mflags::GetFlag(g_x) == -i);
+            assert(mflags::GetFlag(g_z) == std::string("thread_z"));
+            assert(mflags::GetFlag(g_s) == "thread_s");
+          }
+          assert(mflags::GetFlag(g_x) == i);
+          assert(mflags::GetFlag(g_z) == std::string("value_of_z"));
+          assert(mflags::GetFlag(g_s) == "default_s");
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    assert(g_x == 4 && mflags::GetFlag(g_x) == 4);
+    std::cout << "===== All Good ===== " << std::endl;
+  }
+  {
+    std::cout << "===== Test5 ===== " << std::endl;
+    RegisterLateFlag();
+    const char* argv[] = {"./a.out", "--late", "3", "--x", "5"};
+    mflags::ParseFlags(5, argv);
+    assert(g_late == 3 && g_x == 5);
+    std::cout << "===== All Good ===== " << std::endl;
+  }
   if (false) {
     std::cout << "===== Manual Test ===== " << std::endl;
     const char* argv[] = {"./a.out", "--help", "--xyz", "4"};
@@ -1,15 +1,31 @@
 // TODOs:
 // 1. Test out positional params. (var-number of args, fixed args, tuple), and
 //    handle help text for it.
-// 2. Add support for std::tuple and test it out.
-// 3. Add support for required params and test them out.
-// 4. Test out issues with ArgsDescriptor example - field declared twice.
+// 2. Add support for required params and test them out.
+// 3. Test out issues with ArgsDescriptor example - field declared twice.
 
 #include "mflags.h"
 
 #include <cassert>
 #include <iostream>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+#include <sys/stat.h>
+
+// Creates a new empty directory, to be removed by the test.
+std::string MakeTempDir() {
+  char dir[] = "/tmp/mflags_test2_XXXXXX";
+  char* result = mkdtemp(dir);
+  assert(result != nullptr);
+  return result;
+}
 
 void BasicTest() {
   mflags::ArgsDescriptor args_desc{};
@@ -179,6 +195,127 @@ void TestTupleParams() {
   std::cout << "Passed TestTupleParams" << std::endl;
 }
 
+void TestStdTupleParams() {
+  mflags::ArgsDescriptor args_desc{};
+  std::tuple<std::string, int, double, bool> f1;
+  std::vector<std::tuple<const char*, int, char>> f2;
+  int f3 = 0;
+  args_desc.AddArg({.names={"-f1"}}, &f1);
+  args_desc.AddArg({.names={"-f2"}}, &f2);
+  args_desc.AddArg({.names={"-f3"}}, &f3);
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "-f1", "host1", "8080", "0.5", "true", "-f2", "A", "1", "x",
+       "-f3", "7", "-f2", "B", "2", "y"});
+  assert(status.ok());
+  assert(std::get<0>(f1) == "host1" && std::get<1>(f1) == 8080);
+  assert(std::get<2>(f1) == 0.5 && std::get<3>(f1) == true);
+  assert(f2.size() == 2);
+  assert(std::get<0>(f2[0]) == std::string_view("A"));
+  assert(std::get<1>(f2[0]) == 1 && std::get<2>(f2[0]) == 'x');
+  assert(std::get<0>(f2[1]) == std::string_view("B"));
+  assert(std::get<1>(f2[1]) == 2 && std::get<2>(f2[1]) == 'y');
+  assert(f3 == 7);
+
+  status = args_desc.ParseFlagsInternal({"", "-f1", "h", "80", "x.5", "true"});
+  assert(status.str() == "Failed to parse `x.5` as type double for field -f1. "
+        "Expected args of -f1 to be parsable for tuple<string, int, double, bool>");
+
+  status = args_desc.ParseFlagsInternal({"", "-f2", "C", "3", "zz"});
+  assert(status.str() == "Failed to parse `zz` as type char for field -f2. "
+        "Expected args of -f2 to be parsable for tuple<const char*, int, char>");
+  assert(f2.size() == 2);
+
+  status = args_desc.ParseFlagsInternal({"", "-f2", "C", "3"});
+  assert(status.str() == "Invalid number of args for `-f2`. Expected 3 found 2."
+                         " Should be parsable for tuple<const char*, int, char>");
+  assert(f2.size() == 2);
+
+  mflags::ArgsDescriptor args_desc2{};
+  args_desc2.AddArg({.names={"-f1"}, .help_text="For F1"}, &f1);
+  assert(args_desc2.DescList().back().num_needed_args == 4);
+  assert(args_desc2.DescList().back().help_text_left ==
+         "-f1 VALUE1 VALUE2 VALUE3 VALUE4");
+  assert(args_desc2.DescList().back().default_value_str ==
+         "(h, 80, 0.500000, true)");
+
+  std::cout << "Passed TestStdTupleParams" << std::endl;
+}
+
+struct Point {
+  int x = 0, y = 0;
+};
+
+template<>
+struct mflags::FlagTraits<Point> {
+  static bool Parse(std::string_view str, Point& output) {
+    auto comma = str.find(',');
+    if (comma == std::string_view::npos) return false;
+    int64_t x, y;
+    std::string_view rest;
+    if (!mflags::mflags_impl::ParseIntegerPrefix(str.substr(0, comma), x, rest)
+        || !rest.empty()) return false;
+    if (!mflags::mflags_impl::ParseIntegerPrefix(str.substr(comma + 1), y, rest)
+        || !rest.empty()) return false;
+    output = Point{static_cast<int>(x), static_cast<int>(y)};
+    return true;
+  }
+  static std::string TypeName() { return "point"; }
+  static std::string ToString(const Point& p) {
+    return std::to_string(p.x) + "," + std::to_string(p.y);
+  }
+};
+
+void TestFlagTraits() {
+  using namespace std::chrono_literals;
+  mflags::ArgsDescriptor args_desc{};
+  std::chrono::milliseconds f1 = 100ms;
+  mflags::ByteSize f2 = 1 << 20;
+  std::vector<std::chrono::seconds> f3;
+  std::pair<Point, mflags::ByteSize> f4;
+  std::vector<std::tuple<int, Point>> f5;
+  args_desc.AddArg({.names={"-f1"}}, &f1);
+  args_desc.AddArg({.names={"-f2"}}, &f2);
+  args_desc.AddArg({.names={"-f3"}}, &f3);
+  args_desc.AddArg({.names={"-f4"}}, &f4);
+  args_desc.AddArg({.names={"-f5"}}, &f5);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[1].type_string == "duration<ms>");
+  assert(desc_list[1].default_value_str == "100ms");
+  assert(desc_list[2].type_string == "bytes");
+  assert(desc_list[2].default_value_str == "1MiB");
+  assert(desc_list[3].type_string == "vector<duration<s>>");
+  assert(desc_list[4].type_string == "pair<point, bytes>");
+  assert(desc_list[5].type_string == "vector<tuple<int, point>>");
+
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "-f1", "2s", "-f2=64MiB", "-f3", "1m", "2h", "30", "-f4", "3,-4",
+       "1KB", "-f5", "1", "5,6"});
+  assert(status.ok());
+  assert(f1 == 2000ms);
+  assert(f2 == 64u << 20);
+  assert(f3.size() == 3 && f3[0] == 60s && f3[1] == 7200s && f3[2] == 30s);
+  assert(f4.first.x == 3 && f4.first.y == -4 && f4.second == 1000);
+  assert(f5.size() == 1 && std::get<1>(f5[0]).y == 6);
+
+  assert(args_desc.ParseFlagsInternal({"", "-f1", "250"}).ok());
+  assert(f1 == 250ms);
+  assert(args_desc.ParseFlagsInternal({"", "-f2", "512"}).ok());
+  assert(f2 == 512);
+
+  status = args_desc.ParseFlagsInternal({"", "-f1", "1500us"});
+  assert(status.str() == "Failed to parse `1500us` as type duration<ms> for "
+                         "field -f1");
+  status = args_desc.ParseFlagsInternal({"", "-f2", "1XB"});
+  assert(status.str() == "Failed to parse `1XB` as type bytes for field -f2");
+  status = args_desc.ParseFlagsInternal({"", "-f2", "20000000TiB"});
+  assert(!status.ok());
+  status = args_desc.ParseFlagsInternal({"", "-f4", "3", "1KB"});
+  assert(status.str() == "Failed to parse `3` as type point for field -f4. "
+         "Expected args of -f4 to be parsable for pair<point, bytes>");
+
+  std::cout << "Passed TestFlagTraits" << std::endl;
+}
+
 void TestVectorOfCoreTypes() {
   mflags::ArgsDescriptor args_desc{};
   std::vector<int> f1;
@@ -318,6 +455,126 @@ void TestPositionalArgs2() {
   std::cout << "Passed TestPositionalArgs2" << std::endl;
 }
 
+void TestParseTracer() {
+  mflags::ArgsDescriptor args_desc{};
+  int f1 = 0;
+  std::vector<int> f2;
+  int positional = 0;
+  args_desc.AddArg({.names={"-f1"}}, &f1);
+  args_desc.AddArg({.names={"--f\"2"}}, &f2);
+  args_desc.AddArg({.names={"p"}, .positional=true}, &positional);
+  mflags::ParseTracer tracer;
+  args_desc.SetTracer(&tracer);
+  assert(args_desc.ParseFlagsInternal(
+      {"", "-f1", "4", "--f\"2", "5", "6", "-f1", "8", "7"}).ok());
+  std::vector<std::string> names;
+  for (auto& span : tracer.spans()) {
+    names.push_back(span.name + std::string(span.field_name.empty() ? "" : ":")
+                    + span.field_name);
+    assert(span.duration_ns >= 0);
+  }
+  assert((names == std::vector<std::string>{
+      "PreprocessArgDescList", "CreateFieldValues", "parse_func:-f1",
+      "parse_func:--f\"2", "parse_func:-f1", "parse_func:p",
+      "ParsePositionalArgs", "ParseFlags"}));
+  auto json = tracer.ChromeTraceJson();
+  assert(json.rfind("{\"traceEvents\":[\n{\"name\":\"PreprocessArgDescList\","
+                    "\"cat\":\"mflags\",\"ph\":\"X\",\"ts\":", 0) == 0);
+  assert(json.find("\"args\":{\"field\":\"--f\\\"2\"}") != std::string::npos);
+  assert(json.substr(json.size() - 5) == "}\n]}\n");
+
+  // No parse_func span for the positional arg, which isn't given.
+  tracer.Clear();
+  assert(args_desc.ParseFlagsInternal({"", "-f1", "4"}).ok());
+  for ([[maybe_unused]] auto& span : tracer.spans()) {
+    assert(span.field_name != "p");
+  }
+  assert(tracer.spans().size() == 5);
+
+  tracer.Clear();
+  args_desc.SetTracer(nullptr);
+  assert(args_desc.ParseFlagsInternal({"", "-f1", "4"}).ok());
+  assert(tracer.spans().empty());
+
+  std::cout << "Passed TestParseTracer" << std::endl;
+}
+
+int g_sink_sum = 0;
+void AddToSinkSum(int value) { g_sink_sum += value; }
+
+void TestSinkArgs() {
+  mflags::ArgsDescriptor args_desc{};
+  std::vector<int> ids;
+  std::vector<std::pair<int, std::string>> records;
+  int f3 = 0;
+  args_desc.AddArg({.names={"-f1"}}, [&](int id) { ids.push_back(id); });
+  args_desc.AddArg({.names={"-f2"}},
+      [&](const std::pair<int, std::string>& record) -> mflags::Status {
+        if (record.second == "STOP") return mflags::Status::Error("Stopped");
+        records.push_back(record);
+        return mflags::Status::OK;
+      });
+  args_desc.AddArg({.names={"-f3"}}, &f3);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[1].type_string == "vector<int>");
+  assert(desc_list[1].help_text_left == "-f1 VALUES...");
+  assert(desc_list[2].type_string == "vector<pair<int, string>>");
+  assert(desc_list[2].help_text_left == "( -f2 VALUE1 VALUE2 )*");
+
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "-f1", "1", "2", "-f2", "3", "ABC", "-f3", "9", "-f1=4",
+       "-f2", "5", "DEF"});
+  assert(status.ok());
+  assert((ids == std::vector<int>{1, 2, 4}));
+  assert(records.size() == 2 && records[1].first == 5);
+  assert(records[1].second == "DEF");
+  assert(f3 == 9);
+
+  status = args_desc.ParseFlagsInternal({"", "-f2", "6", "STOP"});
+  assert(status.str() == "Stopped");
+  status = args_desc.ParseFlagsInternal({"", "-f1", "7", "x"});
+  assert(status.str() == "Failed to parse `x` as type int for field -f1");
+  assert(ids.size() == 4 && ids[3] == 7);
+
+  // More values than a sink batch, given in one occurrence.
+  ids.clear();
+  std::vector<std::string> values;
+  std::vector<const char*> argv = {"", "-f1"};
+  for (int i = 0; i < 3000; i++) values.push_back(std::to_string(i));
+  for (auto& value : values) argv.push_back(value.c_str());
+  argv.push_back("-f3");
+  argv.push_back("11");
+  assert(args_desc.ParseFlagsInternal(argv).ok());
+  assert(ids.size() == 3000 && ids[0] == 0 && ids[2999] == 2999);
+  assert(f3 == 11);
+
+  // Free functions, by pointer or not.
+  mflags::ArgsDescriptor free_args_desc{};
+  free_args_desc.AddArg({.names={"--sum"}}, &AddToSinkSum);
+  free_args_desc.AddArg({.names={"--sum2"}}, AddToSinkSum);
+  assert(free_args_desc.DescList()[1].type_string == "vector<int>");
+  assert(free_args_desc.ParseFlagsInternal(
+      {"", "--sum", "1", "2", "--sum2", "3"}).ok());
+  assert(g_sink_sum == 6);
+
+  std::cout << "Passed TestSinkArgs" << std::endl;
+}
+
+// Values which look like field names, or contain '='.
+void TestValuesLikeFieldNames() {
+  mflags::ArgsDescriptor args_desc{};
+  std::vector<std::string> f1;
+  std::string f2;
+  args_desc.AddArg({.names={"-f1"}}, &f1);
+  args_desc.AddArg({.names={"f2"}}, &f2);
+  assert(args_desc.ParseFlagsInternal(
+      {"", "-f1", "-f", "a=b", "-f1x", "f", "f2=f2=", "-f1", "=", "-"}).ok());
+  assert((f1 == std::vector<std::string>{"-f", "a=b", "-f1x", "f", "=", "-"}));
+  assert(f2 == "f2=");
+
+  std::cout << "Passed TestValuesLikeFieldNames" << std::endl;
+}
+
 std::string g_expected_help_text = R"(
 This is an example program
 
@@ -328,7 +585,7 @@ Positional Arguments:
 
 Optional Arguments:
 
-  -h, --help              Show this help message and exit. 
+  -h, --help              Show this help message and exit
   -f1 VALUE1 VALUE2       For F1. Type: pair<int, int> ; default: (0, 0)
   -f2, --field2=VALUE     For F2. Type: int ; default: 0
   ( -f4, --field4 VALUE1 VALUE2 )*
@@ -364,6 +621,499 @@ void TestMisc() {
   std::cout << "Passed TestMisc" << std::endl;
 }
 
+void TestOptionalAndAssociative() {
+  mflags::ArgsDescriptor args_desc{};
+  std::optional<int> f1;
+  std::set<std::string> f2;
+  std::map<std::string, int> f3;
+  std::unordered_map<int, double> f4;
+  std::optional<double> f5 = 2.5;
+  args_desc.AddArg({.names={"-f1"}}, &f1);
+  args_desc.AddArg({.names={"-f2"}}, &f2);
+  args_desc.AddArg({.names={"-f3", "--override"}}, &f3);
+  args_desc.AddArg({.names={"-f4"}}, &f4);
+  args_desc.AddArg({.names={"-f5"}}, &f5);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[1].type_string == "optional<int>");
+  assert(desc_list[1].default_value_str == "nullopt");
+  assert(desc_list[2].type_string == "set<string>");
+  assert(desc_list[3].type_string == "map<string, int>");
+  assert(desc_list[3].help_text_left == "-f3, --override KEY=VALUE...");
+  assert(desc_list[4].type_string == "unordered_map<int, double>");
+  assert(desc_list[5].default_value_str == "2.500000");
+
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "-f2", "b", "a", "b", "-f3", "shard=7", "weight=3", "-f1=4",
+       "-f4", "1=0.5", "-f2", "c", "--override", "shard=9", "zone=1",
+       "--override=x=2"});
+  assert(status.ok());
+  assert(f1.has_value() && *f1 == 4);
+  assert((f2 == std::set<std::string>{"a", "b", "c"}));
+  assert((f3 == std::map<std::string, int>{
+      {"shard", 9}, {"weight", 3}, {"zone", 1}, {"x", 2}}));
+  assert(f4.size() == 1 && f4.at(1) == 0.5);
+  assert(f5 == 2.5);
+
+  status = args_desc.ParseFlagsInternal({"", "-f3", "weight"});
+  assert(status.str() == "Expected `key=value` but found `weight` for field "
+                         "-f3 of type map<string, int>");
+  status = args_desc.ParseFlagsInternal({"", "-f4", "x=1"});
+  assert(status.code() == mflags::ErrorCode::kInvalidValue);
+  assert(status.token_index() == 2);
+  assert(status.str() == "Failed to parse key `x` as type int for field -f4");
+  status = args_desc.ParseFlagsInternal({"", "-f4", "2=1", "3=y"});
+  assert(status.str() == "Failed to parse value `y` as type double for "
+                         "field -f4");
+  assert(f4.size() == 1);
+  status = args_desc.ParseFlagsInternal({"", "-f1", "x"});
+  assert(status.str() == "Failed to parse `x` as type optional<int> for "
+                         "field -f1");
+  assert(*f1 == 4);
+
+  std::cout << "Passed TestOptionalAndAssociative" << std::endl;
+}
+
+void TestLayeredParse() {
+  mflags::ArgsDescriptor args_desc{};
+  int batch_size = 1;
+  std::string mode = "fast";
+  double ratio = 0.5;
+  std::vector<int> ids, tags;
+  std::vector<std::string> files;
+  args_desc.AddArg({.names={"--batch_size"}}, &batch_size);
+  args_desc.AddArg({.names={"--mode"}}, &mode);
+  args_desc.AddArg({.names={"--ratio"}}, &ratio);
+  args_desc.AddArg({.names={"--ids"}}, &ids);
+  args_desc.AddArg({.names={"--tags"}, .merge_layers=true}, &tags);
+  args_desc.AddArg({.names={"files"}, .positional=true}, &files);
+
+  std::string path = MakeTempDir() + "/flagfile";
+  {
+    std::ofstream file(path);
+    file << "# Defaults of the deployment.\n"
+         << "--batch_size 8  --mode slow # Comment till end of line.\n"
+         << "file1\n--ids 1 2\n--tags 1 2\n";
+  }
+  mflags::FlagLayer flagfile;
+  assert(mflags::FlagLayer::FromFlagfile(path, &flagfile).ok());
+  std::remove(path.c_str());
+  assert(flagfile.tokens.size() == 11);
+  assert(std::string(flagfile.tokens[3]) == "slow");
+
+  setenv("MFLAGS_TEST_BATCH_SIZE", "16", 1);
+  auto env = mflags::FlagLayer::FromEnv("MFLAGS_TEST_", args_desc);
+  unsetenv("MFLAGS_TEST_BATCH_SIZE");
+  assert(env.tokens.size() == 1);
+  assert(std::string(env.tokens[0]) == "--batch_size=16");
+
+  const char* argv[] = {"prog", "--ids", "3", "--tags", "3", "--ratio", "0.75",
+                        "--ratio=0.25"};
+  auto command_line = mflags::FlagLayer::FromArgv("argv", 8, argv);
+  auto status = args_desc.ParseLayersInternal({flagfile, env, command_line});
+  assert(status.ok());
+  assert(batch_size == 16);
+  assert(mode == "slow");
+  assert(ratio == 0.25);
+  assert((ids == std::vector<int>{3}));
+  assert((tags == std::vector<int>{1, 2, 3}));
+  assert((files == std::vector<std::string>{"file1"}));
+  assert(args_desc.FlagSource("--batch_size") == "env");
+  assert(args_desc.FlagSource("--mode") == path);
+  assert(args_desc.FlagSource("--tags") == "argv");
+  assert(args_desc.FlagSource("--help") == "default");
+
+  status = args_desc.ParseLayersInternal(
+      {command_line, mflags::FlagLayer{.name = "extra", .tokens = {"--mode"}}});
+  assert(status.str() == "extra: Invalid number of args for `--mode`. "
+                         "Expected 1 found 0. Should be of type string");
+
+  // Overridden values aren't converted, so aren't validated either.
+  status = args_desc.ParseLayersInternal({mflags::FlagLayer{
+      .name = "argv", .tokens = {"--ratio", "x", "--ratio=0.25"}}});
+  assert(status.ok() && ratio == 0.25);
+  ids.clear();
+  status = args_desc.ParseLayersInternal(
+      {mflags::FlagLayer{.name = "low", .tokens = {"--ids", "1", "y"}},
+       mflags::FlagLayer{.name = "high", .tokens = {"--ids", "2"}}});
+  assert(status.ok());
+  assert((ids == std::vector<int>{2}));
+  std::cout << "Passed TestLayeredParse" << std::endl;
+}
+
+void TestFlagRegistry() {
+  mflags::ArgsDescriptor args_desc{};
+  int batch_size = 16;
+  std::string mode = "fast";
+  std::vector<int> ids;
+  std::map<std::string, int> limits;
+  args_desc.AddArg({.names={"--batch_size", "-b"}}, &batch_size);
+  args_desc.AddArg({.names={"--mode"}}, &mode);
+  args_desc.AddArg({.names={"--ids"}}, &ids);
+  args_desc.AddArg({.names={"--limits"}}, &limits);
+  args_desc.AddArg({.names={"--sink"}}, [](int) { });
+  mflags::FlagRegistry registry{args_desc};
+  assert(args_desc.ParseFlagsInternal(
+      {"", "-b", "32", "--ids", "1", "2", "--limits", "a=1", "b=2"}).ok());
+  registry.MarkAllChanged();
+  assert(registry.GetFlagValueString("-b") == "32");
+  assert(registry.GetFlagValueString("--ids") == "[1, 2]");
+  assert(registry.GetFlagValueString("--limits") == "{a=1, b=2}");
+  assert(!registry.GetFlagValueString("--sink").has_value());
+  assert(!registry.GetFlagValueString("--unknown").has_value());
+  assert(registry.IsDefault("--batch_size") == false);
+  assert(registry.IsDefault("--mode") == true);
+
+  auto text = registry.TextDump();
+  assert(*text == "-h=false\n"
+                  "--batch_size=32 (default: 16)\n"
+                  "--mode=fast\n"
+                  "--ids=[1, 2] (default: [])\n"
+                  "--limits={a=1, b=2} (default: {})\n");
+  // Cached till a flag is marked changed.
+  mode = "slow";
+  assert(registry.TextDump() == text);
+  assert(registry.MarkChanged("--mode"));
+  assert(!registry.MarkChanged("--unknown"));
+  text = registry.TextDump();
+  assert(text->find("--mode=slow (default: fast)\n") != std::string::npos);
+  auto json = registry.JsonDump();
+  assert(json->find("{\"name\":\"--mode\",\"type\":\"string\","
+                    "\"value\":\"slow\",\"default\":\"fast\","
+                    "\"is_default\":false}") != std::string::npos);
+  assert(registry.JsonDump() == json);
+
+  // Fingerprints cover the non-default values only, in any order.
+  [[maybe_unused]] uint64_t fingerprint = registry.Fingerprint();
+  auto by_name = [](const char* name) {
+    return [name](const mflags::OneArgDesc& desc) {
+      return desc.opts.names[0] == name;
+    };
+  };
+  [[maybe_unused]] uint64_t mode_fingerprint =
+      registry.Fingerprint(by_name("--mode"));
+  assert(registry.Fingerprint(by_name("-h")) == 0);
+  assert(fingerprint == mode_fingerprint +
+         registry.Fingerprint(by_name("--batch_size")) +
+         registry.Fingerprint(by_name("--ids")) +
+         registry.Fingerprint(by_name("--limits")));
+  mode = "fast";
+  registry.MarkChanged("--mode");
+  assert(registry.Fingerprint() == fingerprint - mode_fingerprint);
+  mode = "slow";
+  registry.MarkChanged("--mode");
+  assert(registry.Fingerprint() == fingerprint);
+
+  // Doubles are compared and hashed without the rounding of their display.
+  mflags::ArgsDescriptor ratio_desc{};
+  double ratio = 0.5;
+  ratio_desc.AddArg({.names={"--ratio"}}, &ratio);
+  mflags::FlagRegistry ratio_registry{ratio_desc};
+  ratio = 0.5000001;
+  ratio_registry.MarkChanged("--ratio");
+  assert(ratio_registry.GetFlagValueString("--ratio") == "0.500000");
+  assert(ratio_registry.IsDefault("--ratio") == false);
+  assert(ratio_registry.Fingerprint() != 0);
+  ratio = 0.1234561;
+  ratio_registry.MarkChanged("--ratio");
+  [[maybe_unused]] uint64_t ratio_fingerprint = ratio_registry.Fingerprint();
+  ratio = 0.1234562;
+  ratio_registry.MarkChanged("--ratio");
+  assert(ratio_registry.Fingerprint() != ratio_fingerprint);
+  std::cout << "Passed TestFlagRegistry" << std::endl;
+}
+
+enum class Compression { kNone, kZstd, kLz4, kSnappy };
+
+constexpr mflags::EnumName<Compression> kCompressionNames[] = {
+  {"none", Compression::kNone}, {"zstd", Compression::kZstd},
+  {"lz4", Compression::kLz4}, {"snappy", Compression::kSnappy}};
+
+template<>
+struct mflags::FlagTraits<Compression>
+    : mflags::EnumFlagTraits<Compression, kCompressionNames> { };
+
+void TestEnumFlags() {
+  using Traits = mflags::FlagTraits<Compression>;
+  static_assert(Traits::kTableSize == 8);
+  [[maybe_unused]] Compression value = Compression::kNone;
+  for ([[maybe_unused]] auto& item : kCompressionNames) {
+    assert(Traits::Parse(item.name, value) && value == item.value);
+  }
+  assert(!Traits::Parse("zst", value) && !Traits::Parse("", value));
+  assert(!Traits::Parse("ZSTD", value));
+
+  mflags::ArgsDescriptor args_desc{};
+  Compression compression = Compression::kNone;
+  std::vector<Compression> fallbacks;
+  std::pair<Compression, int> level = {Compression::kZstd, 3};
+  args_desc.AddArg({.names={"--compression"}}, &compression);
+  args_desc.AddArg({.names={"--fallbacks"}}, &fallbacks);
+  args_desc.AddArg({.names={"--level"}}, &level);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[1].type_string == "{none|zstd|lz4|snappy}");
+  assert(desc_list[1].default_value_str == "none");
+  assert(desc_list[3].type_string == "pair<{none|zstd|lz4|snappy}, int>");
+  assert(desc_list[3].default_value_str == "(zstd, 3)");
+
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "--compression=lz4", "--level", "snappy", "1",
+       "--fallbacks", "zstd", "none"});
+  assert(status.ok());
+  assert(compression == Compression::kLz4);
+  assert(level.first == Compression::kSnappy && level.second == 1);
+  assert((fallbacks ==
+          std::vector<Compression>{Compression::kZstd, Compression::kNone}));
+  status = args_desc.ParseFlagsInternal({"", "--compression", "gzip"});
+  assert(status.str() == "Failed to parse `gzip` as type "
+                         "{none|zstd|lz4|snappy} for field --compression");
+  std::cout << "Passed TestEnumFlags" << std::endl;
+}
+
+// Inode of the only file in @dir, 0 if it's empty.
+ino_t CachedIndexInode(const std::string& dir) {
+  ino_t inode = 0;
+  int num_files = 0;
+  for (auto& entry : std::filesystem::directory_iterator(dir)) {
+    struct stat file_stat {};
+    stat(entry.path().c_str(), &file_stat);
+    inode = file_stat.st_ino;
+    num_files++;
+  }
+  assert(num_files <= 1);
+  return inode;
+}
+
+void TestIndexCache() {
+  std::string dir = MakeTempDir();
+  [[maybe_unused]] auto parse = [&](const std::vector<const char*>& argv) {
+    mflags::ArgsDescriptor args_desc{};
+    int batch_size = 0;
+    std::vector<std::string> files;
+    args_desc.AddArg({.names={"--batch_size", "-b"}}, &batch_size);
+    args_desc.AddArg({.names={"--files"}}, &files);
+    args_desc.SetIndexCacheDir(dir);
+    auto status = args_desc.ParseFlagsInternal(argv);
+    assert(status.str() == "" || status.str() == "Unrecognized param: x");
+    return batch_size + static_cast<int>(files.size());
+  };
+  assert(CachedIndexInode(dir) == 0);
+  assert(parse({"", "-b", "3", "--files", "a", "b"}) == 5);
+  [[maybe_unused]] ino_t inode = CachedIndexInode(dir);
+  assert(inode != 0);
+  // Mapped from the cache, which isn't written again.
+  assert(parse({"", "--batch_size=4", "--files", "a"}) == 5);
+  assert(parse({"", "x"}) == 0);
+  assert(CachedIndexInode(dir) == inode);
+
+  // Written to a temporary file, renamed and readable by all.
+  auto path = std::filesystem::directory_iterator(dir)->path();
+  assert(std::distance(std::filesystem::directory_iterator(dir),
+                       std::filesystem::directory_iterator()) == 1);
+  assert(std::filesystem::status(path).permissions() ==
+         (std::filesystem::perms::owner_read |
+          std::filesystem::perms::owner_write |
+          std::filesystem::perms::group_read |
+          std::filesystem::perms::others_read));
+
+  // A cache of other flags or another binary is rebuilt.
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(24);
+    file.write("\xff\xff\xff\xff", 4);
+  }
+  assert(parse({"", "-b", "7"}) == 7);
+  assert(CachedIndexInode(dir) != inode);
+
+  // So is a corrupt one, e.g. with no empty slot left.
+  inode = CachedIndexInode(dir);
+  auto size = std::filesystem::file_size(path);
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(size - 96);
+    file.write(std::string(96, '\x01').data(), 96);
+  }
+  assert(parse({"", "-b", "8", "--files", "a"}) == 9);
+  assert(CachedIndexInode(dir) != inode);
+  std::filesystem::remove_all(dir);
+  std::cout << "Passed TestIndexCache" << std::endl;
+}
+
+void TestRangeSyntax() {
+  mflags::ArgsDescriptor args_desc{};
+  std::vector<int> shards, plain;
+  mflags::IntervalSet ids;
+  args_desc.AddArg({.names={"--shards"}, .range_syntax=true}, &shards);
+  args_desc.AddArg({.names={"--plain"}}, &plain);
+  args_desc.AddArg({.names={"--ids"}}, &ids);
+  [[maybe_unused]] auto& desc_list = args_desc.DescList();
+  assert(desc_list[1].help_text_left == "--shards RANGES...");
+  assert(desc_list[3].type_string == "interval_set");
+
+  auto status = args_desc.ParseFlagsInternal(
+      {"", "--shards", "0..4", "10..0:-5", "7*3", "-2", "1..8:3", "5..5",
+       "9*0"});
+  assert(status.ok());
+  assert((shards == std::vector<int>{0, 1, 2, 3, 4, 10, 5, 0, 7, 7, 7, -2,
+                                     1, 4, 7, 5}));
+  shards.clear();
+  assert(args_desc.ParseFlagsInternal({"", "--shards", "0..4095"}).ok());
+  assert(shards.size() == 4096 && shards.capacity() == 4096);
+  assert(shards.back() == 4095);
+  for (const char* invalid : {"1..", "..3", "1..3:0", "1..3:-1", "3..1:1",
+                              "1...3", "x*2", "2*-1", "0..2147483648",
+                              "1*2*3", "1..3:1x"}) {
+    shards.clear();
+    status = args_desc.ParseFlagsInternal({"", "--shards", "4", invalid});
+    assert(status.str() == "Failed to parse `" + std::string(invalid) +
+                           "` as type int for field --shards");
+    assert(shards.empty());
+  }
+  // Only with range_syntax.
+  status = args_desc.ParseFlagsInternal({"", "--plain", "0..4"});
+  assert(status.str() == "Failed to parse `0..4` as type int for field "
+                         "--plain");
+
+  status = args_desc.ParseFlagsInternal(
+      {"", "--ids", "100..1000000000", "5", "0..9:3", "4", "1000000001",
+       "-4*2"});
+  assert(status.ok());
+  assert(mflags::mflags_impl::ToString(ids) ==
+         "{-4, 0, 3..6, 9, 100..1000000001}");
+  assert(ids.size() == 999999909);
+  assert(ids.Contains(500000000) && ids.Contains(-4) && ids.Contains(5));
+  assert(!ids.Contains(2) && !ids.Contains(7) && !ids.Contains(99));
+  assert(!ids.Contains(1000000002));
+  ids.Add(7, 8);
+  assert(mflags::mflags_impl::ToString(ids) == "{-4, 0, 3..9, 100..1000000001}");
+
+  // Ranges expanding beyond max_range_values are rejected.
+  for (const char* too_large : {"0*4000000000", "0..2147483647"}) {
+    shards.clear();
+    status = args_desc.ParseFlagsInternal({"", "--shards", too_large});
+    assert(status.code() == mflags::ErrorCode::kInvalidValue);
+    assert(status.token_index() == 2 && shards.empty());
+  }
+  status = args_desc.ParseFlagsInternal({"", "--ids", "0..4000000000:2"});
+  assert(status.str() == "Failed to parse `0..4000000000:2` as type "
+                         "interval_set for field --ids");
+  std::vector<int> small;
+  mflags::IntervalSet small_ids;
+  args_desc.AddArg({.names={"--small"}, .range_syntax=true,
+                    .max_range_values=10}, &small);
+  args_desc.AddArg({.names={"--small_ids"}, .max_range_values=3},
+                   &small_ids);
+  assert(args_desc.ParseFlagsInternal({"", "--small", "0..8"}).ok());
+  status = args_desc.ParseFlagsInternal({"", "--small", "9", "10"});
+  assert(status.token() == std::string_view("10") && small.size() == 9);
+  assert(args_desc.ParseFlagsInternal(
+      {"", "--small_ids", "0..1000", "5000..5500:500"}).ok());
+  status = args_desc.ParseFlagsInternal({"", "--small_ids", "-5"});
+  assert(!status.ok() && small_ids.intervals().size() == 3);
+  std::cout << "Passed TestRangeSyntax" << std::endl;
+}
+
+void TestStructuredErrors() {
+  mflags::ArgsDescriptor args_desc{};
+  int f1 = 0;
+  std::pair<int, std::string> f2;
+  std::string fp;
+  std::vector<int> f3;
+  args_desc.AddArg({.names={"--f1"}}, &f1);
+  args_desc.AddArg({.names={"--f2"}}, &f2);
+  args_desc.AddArg({.names={"fp"}, .positional=true, .required=true}, &fp);
+  args_desc.AddArg({.names={"--f3"}}, &f3);
+  using mflags::ErrorCode;
+
+  auto status = args_desc.ParseFlagsInternal({"", "p", "--f1", "x"});
+  assert(status.code() == ErrorCode::kInvalidValue);
+  assert(status.flag_index() == 1 && status.token_index() == 3);
+  assert(std::string(status.token()) == "x");
+  assert(status.str() == "Failed to parse `x` as type int for field --f1");
+
+  status = args_desc.ParseFlagsInternal({"", "p", "--f3", "1", "y", "--f1=z"});
+  assert(status.code() == ErrorCode::kInvalidValue);
+  assert(status.flag_index() == 4 && status.token_index() == 4);
+  status = args_desc.ParseFlagsInternal({"", "p", "--f1=z"});
+  assert(status.flag_index() == 1 && status.token_index() == 2);
+
+  status = args_desc.ParseFlagsInternal({"", "p", "--f2", "a", "b"});
+  assert(status.code() == ErrorCode::kInvalidValue);
+  assert(status.flag_index() == 2 && status.token_index() == 3);
+  assert(status.str() == "Failed to parse `a` as type int for field --f2. "
+                         "Expected args of --f2 to be parsable for "
+                         "pair<int, string>");
+
+  status = args_desc.ParseFlagsInternal({"", "p", "--f2", "1"});
+  assert(status.code() == ErrorCode::kInvalidNumArgs);
+  assert(status.flag_index() == 2 && status.token_index() == 2);
+  assert(status.str() == "Invalid number of args for `--f2`. Expected 2 found "
+                         "1. Should be parsable for pair<int, string>");
+
+  status = args_desc.ParseFlagsInternal({"", "--f1", "3"});
+  assert(status.code() == ErrorCode::kMissingPositional);
+  assert(status.flag_index() == 3 && status.token_index() == -1);
+  assert(status.str() == "Required positional arg fp not found.");
+
+  status = args_desc.ParseFlagsInternal({"", "p", "q", "--f1", "3", "r"});
+  assert(status.code() == ErrorCode::kUnrecognizedParam);
+  assert(status.flag_index() == -1 && status.token_index() == 2);
+  assert(status.str() == "Unrecognized param: q r");
+  status = args_desc.ParseFlagsInternal(
+      {"", "p", "q", "r", "--f1", "3", "s", "t", "u"});
+  assert(status.token_index() == 2);
+  assert(status.str() == "Unrecognized param: q r s t (and 1 more)");
+
+  // Text appended to a structured error, and free-form errors.
+  status = args_desc.ParseFlagsInternal({"", "p", "--f1", "x"});
+  status << " (from the admin socket)";
+  assert(status.code() == ErrorCode::kInvalidValue);
+  assert(status.str() == "Failed to parse `x` as type int for field --f1 "
+                         "(from the admin socket)");
+  assert(mflags::Status::Error("abc").code() == ErrorCode::kMessage);
+  assert(mflags::Status(mflags::Status::OK).code() == ErrorCode::kOk);
+
+  // Layers locate the token in the tokens of the layer.
+  mflags::FlagLayer layer{"extra", {"p", "--f1", "4", "--f1", "w"}, nullptr};
+  status = args_desc.ParseLayersInternal({layer});
+  assert(status.code() == ErrorCode::kInvalidValue);
+  assert(status.flag_index() == 1 && status.token_index() == 4);
+  assert(status.str() == "extra: Failed to parse `w` as type int for field "
+                         "--f1");
+
+  // Errors of layers don't refer to their tokens, which may be gone.
+  std::string path = MakeTempDir() + "/flagfile";
+  std::ofstream(path) << "p --f1 5 stray_positional\n";
+  {
+    mflags::FlagLayer flagfile;
+    assert(mflags::FlagLayer::FromFlagfile(path, &flagfile).ok());
+    flagfile.name = "flagfile";
+    status = args_desc.ParseLayersInternal({flagfile});
+  }
+  assert(status.code() == ErrorCode::kUnrecognizedParam);
+  assert(status.token_index() == 3);
+  assert(status.str() == "flagfile: Unrecognized param: stray_positional");
+  std::filesystem::remove_all(std::filesystem::path(path).parent_path());
+
+  // Errors outlive the argv they come from, e.g. a command of an admin
+  // socket, with tokens longer than small strings.
+  auto parse_strings = [&](std::vector<std::string> strings) {
+    std::vector<const char*> argv;
+    for (auto& str : strings) argv.push_back(str.c_str());
+    return args_desc.ParseFlagsInternal(argv);
+  };
+  status = parse_strings({"", "p", "--f1=value_longer_than_small_strings"});
+  assert(std::string(status.token()) == "value_longer_than_small_strings");
+  assert(status.str() == "Failed to parse `value_longer_than_small_strings` "
+                         "as type int for field --f1");
+  status = parse_strings({"", "p", "--f2", "1"});
+  assert(status.str() == "Invalid number of args for `--f2`. Expected 2 "
+                         "found 1. Should be parsable for pair<int, string>");
+  status = parse_strings({"", "p", "unrecognized_token_1", "token_2"});
+  assert(status.str() == "Unrecognized param: unrecognized_token_1 token_2");
+
+  std::cout << "Passed TestStructuredErrors" << std::endl;
+}
+
 int main() {
   BasicTest();
   InvalidInputTest_Basic();
@@ -372,10 +1122,22 @@ int main() {
   InvalidInputTest_NumArgs();
   TestEqualsToAfterName();
   TestTupleParams();
+  TestStdTupleParams();
+  TestFlagTraits();
+  TestOptionalAndAssociative();
   TestVectorOfCoreTypes();
   TestVectorOfTupleOfCoreTypes();
   TestOverwriteValue();
   TestPositionalArgs();
   TestPositionalArgs2();
   TestHelpText();
+  TestParseTracer();
+  TestSinkArgs();
+  TestValuesLikeFieldNames();
+  TestLayeredParse();
+  TestFlagRegistry();
+  TestEnumFlags();
+  TestIndexCache();
+  TestRangeSyntax();
+  TestStructuredErrors();
 }